@@ -542,7 +542,8 @@ axp803link(void)
 	ctlr.lastbrightness = brightness;
 
 	rintrinit();
-	intrenable(IRQpmic, axp803interrupt, &ctlr, BUSUNKNOWN, "axp803");
+	/* the handler talks to the pmic over rsb, too slow for interrupt level */
+	intrenable(IRQpmic|IRQthread, axp803interrupt, &ctlr, BUSUNKNOWN, "axp803");
 
 	addarchfile("battery", 0444, batteryread, nil);
 }
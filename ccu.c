@@ -596,6 +596,22 @@ getclkrate(int clkid)
 		m = (reg & 0xf)+1;
 		return ref / n / m;
 	case AHB1_APB1_CFG_REG:
+		/* the ahb1 clock, apb1 is a divider below it */
+		switch((reg >> 12) & 0x3){
+		case 0:
+			ref = 32*1000;
+			break;
+		case 1:
+			ref = SYSCLOCK;
+			break;
+		case 3:
+			ref = getclkrate(PLL_PERIPH0_CTRL_REG) / (((reg >> 6) & 0x3)+1);
+			break;
+		default:
+			return 0;	/* from axi, not handled */
+		}
+		n = 1 << ((reg >> 4) & 0x3);
+		return ref / n;
 	case APB2_CFG_REG:
 		ref = (reg >> 24) & 0x3;
 		if (ref == 0)
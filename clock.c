@@ -9,6 +9,7 @@
 #include "io.h"
 #include "ureg.h"
 #include "../arm64/sysreg.h"
+#include "../port/error.h"
 
 static uvlong freq;
 
@@ -16,8 +17,37 @@ enum {
 	Enable	= 1<<0,
 	Imask	= 1<<1,
 	Istatus = 1<<2,
+
+	Maxtval	= 0x7FFFFFFF,	/* CNTP_TVAL is signed */
+
+	/* CNTKCTL_EL1 */
+	El0vcten	= 1<<1,
+	Evnten	= 1<<2,
+	Evntishift	= 4,
+	Evntperiod	= 10,	/* µs, at most, between events */
 };
 
+/*
+ * µs() is (ticks*usmul)>>32, it only returns the low 32
+ * bits anyway. The delays wait for the timer's event stream
+ * with WFE, up to the last event before they are done.
+ */
+static uvlong usmul;
+static uvlong usticks;	/* ticks per µs, <<16 */
+static uvlong evticks;	/* between events */
+static ulong kctl;
+
+/*
+ * The clock tick of cpus other than cpu0 is a timer of our
+ * own rather than the one from timersinit, so that idlehands
+ * can take it off the queue while the cpu is idle. hzdue is
+ * when the next tick is due, ticks missed while idle are
+ * added to m->ticks when the cpu wakes.
+ */
+static Timer hztimer[MAXMACH];
+static uvlong hzdue[MAXMACH];
+static int tickless = 1;
+
 void
 clockshutdown(void)
 {
@@ -26,19 +56,83 @@ clockshutdown(void)
 static void
 localclockintr(Ureg *ureg, void *)
 {
+	/* in case no timer is left to set it */
+	syswr(CNTP_TVAL_EL0, Maxtval);
 	timerintr(ureg, 0);
 }
 
+static void
+hzarm(Timer *t, uvlong now)
+{
+	t->tns = 0;
+	if(hzdue[m->machno] > now)
+		t->tns = fastticks2ns(hzdue[m->machno] - now);
+	timeradd(t);
+}
+
+static void
+hztick(Ureg *ureg, Timer *t)
+{
+	hzclock(ureg);
+	hzdue[m->machno] += freq/HZ;
+	hzarm(t, fastticks(nil));
+}
+
+/* in place of timersinit on the other cpus */
+void
+hzinit(void)
+{
+	Timer *t;
+
+	t = &hztimer[m->machno];
+	t->tmode = Trelative;
+	t->tf = hztick;
+	hzdue[m->machno] = fastticks(nil) + freq/HZ;
+	hzarm(t, fastticks(nil));
+}
+
+/*
+ * Stop the tick while idle, the timer is then only set for
+ * the cpu's other timers. cpu0 keeps ticking, it keeps
+ * the time.
+ */
+void
+idlehands(void)
+{
+	Timer *t;
+	uvlong now;
+
+	t = &hztimer[m->machno];
+	/* the event stream would wake it */
+	syswr(CNTKCTL_EL1, kctl & ~Evnten);
+	if(m->machno == 0 || !tickless || t->tf == nil){
+		idlewait();
+		syswr(CNTKCTL_EL1, kctl);
+		return;
+	}
+	timerdel(t);
+	idlewait();
+	syswr(CNTKCTL_EL1, kctl);
+	now = fastticks(nil);
+	while(hzdue[m->machno] <= now){
+		m->ticks++;
+		hzdue[m->machno] += freq/HZ;
+	}
+	hzarm(t, now);
+}
+
 void
 clockinit(void)
 {
 	uvlong tstart, tend;
 	ulong t0, t1;
+	int i;
 
 	syswr(PMCR_EL0, 1<<6 | 7);
 	syswr(PMCNTENSET, 1<<31);
-	syswr(PMUSERENR_EL0, 1<<2);
-	syswr(CNTKCTL_EL1, 1<<1);
+	/* user space may read the cycle and event counters */
+	syswr(PMUSERENR_EL0, 1<<3 | 1<<2);
+	syswr(CNTKCTL_EL1, El0vcten);
 
 	syswr(CNTP_TVAL_EL0, ~0UL);
 	syswr(CNTP_CTL_EL0, Enable);
@@ -46,6 +140,16 @@ clockinit(void)
 	if(m->machno == 0){
 		freq = sysrd(CNTFRQ_EL0);
 		print("timer frequency %lld Hz\n", freq);
+		if(getconf("*notickless") != nil)
+			tickless = 0;
+
+		usmul = (1000000ULL << 32) / freq;
+		usticks = (freq << 16) / 1000000;
+		for(i = 15; i > 0; i--)
+			if(2ULL<<i <= freq/1000000*Evntperiod)
+				break;
+		evticks = 2ULL<<i;
+		kctl = El0vcten | Evnten | i<<Evntishift;
 
 		/* TURBO! */
 //		setclkrate("ccm_arm_a53_clk_root", "osc_25m_ref_clk", 25*Mhz);
@@ -65,6 +169,7 @@ clockinit(void)
 	t1 -= t0;
 	m->cpuhz = 100 * t1;
 	m->cpumhz = (m->cpuhz + Mhz/2 - 1) / Mhz;
+	syswr(CNTKCTL_EL1, kctl);
 
 	/*
 	 * we are using virtual counter register CNTVCT_EL0
@@ -103,18 +208,72 @@ perfticks(void)
 ulong
 µs(void)
 {
-	uvlong hz;
-	uvlong t = fastticks(&hz);
-	return (t * 1000000ULL) / hz;
+	return (fastticks(nil) * usmul) >> 32;
 }
 
 void
 microdelay(int n)
 {
-	ulong now;
+	uvlong end;
 
-	now = µs();
-	while(µs() - now < n);
+	if(n <= 0)
+		return;
+	end = fastticks(nil) + ((uvlong)n*usticks >> 16);
+	/* not in an interrupt taken while idle */
+	if(sysrd(CNTKCTL_EL1) & Evnten)
+		while((vlong)(end - fastticks(nil)) > evticks)
+			wfe();
+	while((vlong)(end - fastticks(nil)) > 0)
+		;
+}
+
+static int
+utfn(void *arg)
+{
+	return up->trend == nil || up->tfn(arg);
+}
+
+static void
+utwakeup(Ureg*, Timer *t)
+{
+	Proc *p;
+	Rendez *r;
+
+	p = t->ta;
+	r = p->trend;
+	if(r != nil){
+		p->trend = nil;
+		wakeup(r);
+	}
+}
+
+/*
+ * tsleep, with the timeout in µs. The process timer sets
+ * the generic timer for the deadline itself, not a tick, so
+ * a short wait blocks where microdelay would spin.
+ */
+void
+utsleep(Rendez *r, int (*fn)(void*), void *arg, ulong n)
+{
+	if(up->tt != nil)
+		timerdel(up);
+	up->tns = (vlong)n*1000;
+	up->tf = utwakeup;
+	up->tmode = Trelative;
+	up->ta = up;
+	up->trend = r;
+	up->tfn = fn;
+	timeradd(up);
+
+	if(waserror()){
+		up->trend = nil;
+		timerdel(up);
+		nexterror();
+	}
+	sleep(r, utfn, arg);
+	up->trend = nil;
+	timerdel(up);
+	poperror();
 }
 
 void
@@ -142,3 +301,169 @@ synccycles(void)
 	r1.ref = 0;
 	splx(s);
 }
+
+/*
+ * Counter skew. Each cpu in turn answers a ping from the one
+ * measuring, both reading CNTPCT and the cycle counter; the
+ * round trip that was shortest gives the offset, to within
+ * half of it. The offsets are kept relative to cpu0.
+ */
+enum {
+	Skewrounds	= 64,
+};
+
+typedef struct Skew Skew;
+struct Skew {
+	int	valid;
+	vlong	off;	/* ticks ahead of cpu0 */
+	vlong	err;
+	vlong	coff;	/* cycles ahead of cpu0 */
+	vlong	cerr;
+};
+
+static struct {
+	int	ping;
+	int	pong;
+	uvlong	t;
+	uvlong	c;
+} skw;
+
+static QLock skewlock;
+static Skew skew[MAXMACH];
+static ulong skewwhen;
+
+static void
+skewpong(void*)
+{
+	int i;
+
+	for(i = 1; i <= Skewrounds; i++){
+		while(skw.ping != i)
+			coherence();
+		skw.t = fastticks(nil);
+		skw.c = lcycles();
+		coherence();
+		skw.pong = i;
+	}
+}
+
+static void
+skewmeasure(int cpu, Skew *sk)
+{
+	uvlong t0, t2, c0, c2, best, cbest;
+	int i, s;
+
+	skw.ping = skw.pong = 0;
+	coherence();
+	s = splhi();
+	if(!sgipost(cpu, skewpong, nil)){
+		splx(s);
+		sk->valid = 0;
+		return;
+	}
+	best = cbest = ~0ULL;
+	for(i = 1; i <= Skewrounds; i++){
+		t0 = fastticks(nil);
+		c0 = lcycles();
+		coherence();
+		skw.ping = i;
+		while(skw.pong != i)
+			coherence();
+		c2 = lcycles();
+		t2 = fastticks(nil);
+		if(t2 - t0 < best){
+			best = t2 - t0;
+			sk->off = skw.t - (t0 + best/2);
+		}
+		if(c2 - c0 < cbest){
+			cbest = c2 - c0;
+			sk->coff = skw.c - (c0 + cbest/2);
+		}
+	}
+	sgiwait();
+	splx(s);
+	sk->err = (best+1)/2;
+	sk->cerr = (cbest+1)/2;
+	sk->valid = 1;
+}
+
+/* measure all cpus, at boot and for #P/skew */
+void
+skewcheck(void)
+{
+	Skew *sk, *base;
+	int i, s;
+
+	qlock(&skewlock);
+	/* stay on one cpu */
+	s = splhi();
+	for(i = 0; i < conf.nmach; i++){
+		sk = &skew[i];
+		if(i == m->machno){
+			memset(sk, 0, sizeof(*sk));
+			sk->valid = 1;
+		}else
+			skewmeasure(i, sk);
+	}
+	/* relative to cpu0 rather than to whichever cpu we are on */
+	base = &skew[0];
+	if(base->valid && m->machno != 0)
+		for(i = 0; i < conf.nmach; i++){
+			sk = &skew[i];
+			if(!sk->valid || sk == base)
+				continue;
+			sk->off -= base->off;
+			sk->err += base->err;
+			sk->coff -= base->coff;
+			sk->cerr += base->cerr;
+		}
+	if(base->valid && m->machno != 0){
+		base->off = base->coff = 0;
+		base->err = base->cerr = 0;
+	}
+	splx(s);
+	skewwhen = TK2MS(MACHP(0)->ticks);
+	for(i = 1; i < conf.nmach; i++){
+		sk = &skew[i];
+		if(sk->valid && (sk->off > sk->err || -sk->off > sk->err))
+			print("cpu%d: counter is %lld ticks off cpu0\n", i, sk->off);
+	}
+	qunlock(&skewlock);
+}
+
+/*
+ * cpu, counter offset and error in ns, cycle counter offset
+ * and error, the clock rate clockinit measured.
+ */
+long
+skewread(Chan*, void *a, long n, vlong offset)
+{
+	Skew *sk;
+	char *p;
+	int i, l;
+
+	p = smalloc(READSTR);
+	qlock(&skewlock);
+	l = snprint(p, READSTR, "measured %lud ms\n", skewwhen);
+	for(i = 0; i < conf.nmach; i++){
+		sk = &skew[i];
+		if(!sk->valid)
+			continue;
+		l += snprint(p+l, READSTR-l, "cpu%d counter %lld ±%lld ns cycles %lld ±%lld mhz %d\n",
+			i, sk->off*1000000000LL/(vlong)freq, sk->err*1000000000LL/(vlong)freq,
+			sk->coff, sk->cerr, MACHP(i)->cpumhz);
+	}
+	qunlock(&skewlock);
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+long
+skewwrite(Chan*, void *a, long n, vlong)
+{
+	if(n < 7 || strncmp(a, "measure", 7) != 0)
+		error(Ebadctl);
+	skewcheck();
+	return n;
+}
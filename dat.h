@@ -1,21 +1,23 @@
 /*
  * Time.
  *
- * HZ should divide 1000 evenly, ideally.
- * 100, 125, 200, 250 and 333 are okay.
+ * HZ is set at boot with *hz=, see confinit.
+ * It must divide 1000 evenly.
  */
-#define	HZ		100			/* clock frequency */
+#define	HZ		(conf.hz)		/* clock frequency */
 #define	MS2HZ		(1000/HZ)		/* millisec per clock tick */
 #define	TK2SEC(t)	((t)/HZ)		/* ticks to seconds */
  
 enum {
 	Mhz	= 1000 * 1000,
+	Npmuctr	= 5,		/* per process event counters, see pmu.c */
 };
 
 typedef struct Conf	Conf;
 typedef struct Confmem	Confmem;
 typedef struct FPalloc	FPalloc;
 typedef struct FPsave	FPsave;
+typedef struct Hstimer	Hstimer;
 typedef struct PFPU	PFPU;
 typedef struct ISAConf	ISAConf;
 typedef struct Label	Label;
@@ -109,6 +111,7 @@ struct Conf
 	ulong	nswap;		/* number of swap pages */
 	int	nswppo;		/* max # of pageouts per segment pass */
 	int	monitor;	/* flag */
+	ulong	hz;		/* clock ticks per second */
 };
 
 /*
@@ -133,6 +136,12 @@ struct PMMU
 	Page	*mmutail[PTLEVELS];
 	int	asid;
 	uintptr	tpidr;
+
+	/* event counters, see pmu.c */
+	int	pmun;
+	int	pmudirty;
+	u32int	pmuevt[Npmuctr];
+	uvlong	pmuval[Npmuctr];
 };
 
 #include "../port/portdat.h"
@@ -188,6 +197,18 @@ struct ISAConf {
 	char	*opt[NISAOPT];
 };
 
+/*
+ *  one-shot event on the high speed timer, see hstmr.c
+ */
+struct Hstimer
+{
+	uvlong	when;		/* in hstmrticks */
+	void	(*f)(Ureg*, Hstimer*);
+	void	*a;
+	Hstimer	*next;
+	int	on;
+};
+
 /*
  * Horrid. But the alternative is 'defined'.
  */
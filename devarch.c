@@ -10,7 +10,7 @@ enum {
 	Qdir = 0,
 	Qbase,
 
-	Qmax = 16,
+	Qmax = 32,
 };
 
 typedef long Rdwrfn(Chan*, void*, long, vlong);
@@ -495,6 +495,9 @@ archinit(void)
 	addarchfile("irqen", 0444, irqenread, nil);
 	addarchfile("irqpend", 0444, irqpendread, nil);
 	addarchfile("irqact", 0444, irqactread, nil);
+	addarchfile("irqctl", 0664, intrctlread, intrctlwrite);
+	addarchfile("irqstat", 0444, intrstatread, nil);
+	addarchfile("skew", 0664, skewread, skewwrite);
 	addarchfile("pmic", 0664, pmicread, pmicwrite);
 	// addarchfile("led", 0664, ledread, ledwrite);
 }
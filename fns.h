@@ -6,7 +6,12 @@ extern int tas(void *);
 extern int cmpswap(long*, long, long);
 extern void coherence(void);
 extern void idlehands(void);
+extern void idlewait(void);
+extern void wfe(void);
+extern void hzinit(void);
+extern void utsleep(Rendez*, int (*)(void*), void*, ulong);
 extern uvlong vcycles(void);
+extern uvlong lcycles(void);
 #define cycles(ip) *(ip) = vcycles()
 extern int splfhi(void);
 extern void splflo(void);
@@ -91,6 +96,15 @@ extern void synccycles(void);
 extern void armtimerset(int);
 extern void clockshutdown(void);
 
+/* hstmr */
+extern ulong hstmrfreq(void);
+extern uvlong hstmrticks(void);
+extern uvlong hstmrns(uvlong);
+extern uvlong hstmrnsticks(uvlong);
+extern void hstmradd(Hstimer*);
+extern void hstmrdel(Hstimer*);
+extern void hstmrsleep(uvlong);
+
 /* fpu */
 extern void fpuinit(void);
 extern void fpon(void);
@@ -105,6 +119,10 @@ extern void fpuprocsave(Proc*);
 extern void fpuprocfork(Proc*);
 extern void fpuprocsetup(Proc*);
 extern void fpuprocrestore(Proc*);
+extern void pmuprocsave(Proc*);
+extern void pmuprocfork(Proc*);
+extern void pmuprocsetup(Proc*);
+extern void pmuprocrestore(Proc*);
 extern void mathtrap(Ureg*);
 
 /* trap */
@@ -127,6 +145,17 @@ extern void intrcpushutdown(void);
 extern void intrsoff(void);
 extern void intrenable(int, void (*)(Ureg*, void*), void*, int, char*);
 extern void intrdisable(int, void (*)(Ureg*, void*), void*, int, char*);
+extern void intrprio(int, int);
+extern void intraffinity(int, int);
+extern void intrthreads(void);
+extern long intrstatread(Chan*, void*, long, vlong);
+extern void sgiinit(void);
+extern void sgicall(int, void (*)(void*), void*);
+extern int sgipost(int, void (*)(void*), void*);
+extern void sgiwait(void);
+extern void skewcheck(void);
+extern long skewread(Chan*, void*, long, vlong);
+extern long skewwrite(Chan*, void*, long, vlong);
 extern int irq(Ureg*);
 extern void fiq(Ureg*);
 extern void intrinit(void);
@@ -134,6 +163,8 @@ extern void intrinit(void);
 extern int isintrenable(int);
 extern int isintrpending(int);
 extern int isintractive(int);
+extern long intrctlread(Chan*, void*, long, vlong);
+extern long intrctlwrite(Chan*, void*, long, vlong);
 
 
 /* sysreg */
@@ -147,6 +178,7 @@ extern void writeconf(void);
 extern int isaconfig(char*, int, ISAConf*);
 extern void links(void);
 extern void dmaflush(int, void*, ulong);
+extern void addshutdown(void (*)(void));
 
 
 /* uart */
@@ -228,8 +260,16 @@ extern void modeminit(void);
 extern int piocfg(char *name, int val);
 extern int pioset(char *name, int on);
 extern int pioget(char *name);
+extern int piopull(char *name, int pull);
 extern void pioeintcfg(char *name, int val);
 
+/* sdio, sdhc.c */
+extern int sdioattach(int fn, void (*intr)(void*), void *arg);
+extern void sdioblksize(int fn, int size);
+extern int sdiordb(int fn, ulong addr);
+extern void sdiowrb(int fn, ulong addr, int v);
+extern long sdiorw(int write, int fn, ulong addr, int incr, void *buf, long len);
+
 /* touch */
 extern void touchwait(void);
 
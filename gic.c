@@ -104,11 +104,174 @@ struct Vctl {
 	void	*a;
 	int	irq;
 	u32int	intid;
+	char	name[KNAMELEN];
+	ulong	count[MAXMACH];
+	uvlong	cycles[MAXMACH];	/* in f, less nested interrupts */
+	ulong	maxcycles;
+
+	int	nest;		/* IRQnest */
+	int	threaded;
+	int	started;
+	int	pending;
+	int	dead;		/* unlinked, leave the source masked */
+	int	done;		/* kproc should exit */
+	int	exited;
+	Rendez	r;
+};
+
+/*
+ * Interrupt affinity. Each SPI is routed to one cpu, set from
+ * #P/irqctl or moved by the balancer, which every Balanceperiod
+ * hands the busiest sources to the least loaded cpus. Sources
+ * given a cpu by hand stay where they were put.
+ */
+enum {
+	Nintid		= 256,	/* 32 private and 224 shared on the A64 */
+	Balanceperiod	= 1000,	/* ms */
+	Balancemin	= 50,	/* interrupts per period before a source is moved */
+
+	Stormwindow	= 100,	/* ms */
+	Stormmax	= 20000,	/* interrupts per window */
+	Stormback	= 100,	/* ms masked after the first storm */
+	Stormbackmax	= 10000,
+	Stormforget	= 60000,	/* ms without a storm to start over */
+};
+
+/*
+ * Storm detection. A shared source that interrupts more than
+ * stormmax times in a window is masked for a while, each storm
+ * following soon after the last doubles the time. The clock on
+ * cpu0 unmasks them again.
+ */
+typedef struct Storm Storm;
+struct Storm {
+	ulong	start;	/* ms, of the window */
+	ulong	n;
+	int	masked;
+	ulong	until;
+	ulong	backoff;
+	ulong	last;
+	ulong	storms;
+};
+
+typedef struct Route Route;
+struct Route {
+	int	used;
+	int	cpu;
+	int	pinned;
+	ulong	last;	/* count at the previous balance */
+	ulong	rate;	/* interrupts in the last period */
+};
+
+/*
+ * Priority classes. The binary point is kept at its minimum so
+ * that each class is a preemption group of its own. A shared
+ * source in the Iio or Islow class whose handlers were all
+ * enabled with IRQnest runs them with interrupts enabled, so a
+ * clock or network interrupt can preempt them; others run at
+ * splhi until EOI as before. Nothing reschedules while nested:
+ * up->preempted is held so that trap's preempted() does not
+ * sched, and a clock interrupt taken then is passed on to the
+ * outermost irq().
+ */
+static uchar classprio[Niclass] = { 0x20, 0x40, 0x80, 0xC0 };
+static char *classname[Niclass] = { "clock", "net", "io", "slow" };
+
+static struct {
+	int	irq;
+	int	class;
+} defclass[] = {
+	IRQresched,	Iclock,
+	IRQcall,	Iclock,
+	IRQcntps,	Iclock,
+	IRQcntpns,	Iclock,
+	IRQcpupmu,	Iclock,
+	IRQcpupmu+1,	Iclock,
+	IRQcpupmu+2,	Iclock,
+	IRQcpupmu+3,	Iclock,
+	IRQtimer0,	Iclock,
+	IRQtimer1,	Iclock,
+	IRQtimerhs,	Iclock,
+	IRQemac,	Inet,
+	IRQotgehci,	Inet,
+	IRQotgohci,	Inet,
+	IRQusbehci,	Inet,
+	IRQusbohci,	Inet,
+	IRQtwi0,	Islow,
+	IRQtwi1,	Islow,
+	IRQtwi2,	Islow,
+	IRQkeyadc,	Islow,
+	IRQthermal,	Islow,
+	IRQpmic,	Islow,
+	IRQrsb,		Islow,
 };
 
+/*
+ * Handlers, by intid: per cpu for the private interrupts, one
+ * list for each shared one. irq() walks the lists without
+ * locking, entries are published and unlinked with a single
+ * pointer store under vctllock.
+ */
 static Lock vctllock;
-static Vctl *vctl[MAXMACH][32], *vfiq;
+static Vctl *vctl[MAXMACH][32], *vspi[Nintid], *vfiq;
 static u32int *cregs, *dregs;
+static Route route[Nintid];
+static int balancing, balancer;
+static uchar iclass[Nintid];
+static uchar classset[Nintid];
+static uchar nestok[Nintid];
+static int depth[MAXMACH];
+static int nestclock[MAXMACH];
+static ulong exits[MAXMACH];	/* outermost irq() returns */
+static uvlong incycles[MAXMACH];	/* in handlers, for nesting */
+
+static Lock stormlock;
+static Storm storm[Nintid];
+static ulong stormmax = Stormmax;
+static int nstorm;	/* sources masked */
+
+/* remote calls, one at a time */
+static Lock calllock;
+static struct {
+	void	(*f)(void*);
+	void	*a;
+} call;
+static uchar callwait[MAXMACH];
+static int sgion[MAXMACH];
+
+static QLock threadlock;
+
+static int kick(void);
+static void stormcheck(u32int);
+static void stormrelease(void);
+
+static Vctl**
+vlist(u32int intid, int cpu)
+{
+	if(intid < 32)
+		return &vctl[cpu][intid];
+	return &vspi[intid];
+}
+
+/* called under vctllock when the handlers of intid change */
+static void
+setnest(u32int intid)
+{
+	Vctl *v;
+	int ok;
+
+	if(intid < 32)
+		return;
+	ok = 0;
+	for(v = vspi[intid]; v != nil; v = v->next){
+		if(!v->nest){
+			ok = 0;
+			break;
+		}
+		ok = 1;
+	}
+	nestok[intid] = ok;
+}
 
 void
 intrcpushutdown(void)
@@ -157,30 +320,87 @@ intrsoff(void)
 
 /*
  *  called by trap to handle irq interrupts.
- *  returns true iff a clock interrupt, thus maybe reschedule.
+ *  returns true iff a clock interrupt or a reschedule request,
+ *  thus maybe reschedule.
  */
 int
 irq(Ureg* ureg)
 {
+	extern int nrdy;
 	Vctl *v;
-	int clockintr;
-	u32int intid;
+	int clockintr, preempt, rdy, held;
+	u32int iar, intid;
+	uvlong t, n;
 
 	m->intr++;
-	intid = cregs[GICC_IAR] & 0xFFFFFF;
+	iar = cregs[GICC_IAR];
+	intid = iar & 0x3FF;	/* an SGI also carries the sending cpu */
 	if((intid & ~3) == 1020)
 		return 0; // spurious
+	if(intid >= Nintid){
+		cregs[GICC_EOIR] = iar;
+		return 0;
+	}
+	rdy = nrdy;
+	depth[m->machno]++;
+	coherence();
+	preempt = nestok[intid] && iclass[intid] >= Iio;
+	held = 0;
+	if(preempt){
+		if(up != nil){
+			held = up->preempted;
+			up->preempted = 1;
+		}
+		spllo();
+	}
 	clockintr = 0;
-	for(v = vctl[m->machno][intid%32]; v != nil; v = v->next)
-		if(v->intid == intid){
-			coherence();
-			v->f(ureg, v->a);
+	for(v = intid < 32 ? vctl[m->machno][intid] : vspi[intid]; v != nil; v = v->next){
+		v->count[m->machno]++;
+		coherence();
+		if(v->threaded){
+			/* masked until the kproc has run the handler */
+			dregs[GICD_ICENABLER0 + (intid/32)] = 1 << (intid%32);
+			v->pending = 1;
 			coherence();
-			if(v->irq == IRQcntps || v->irq == IRQcntpns)
-				clockintr = 1;
+			wakeup(&v->r);
+			continue;
 		}
+		n = incycles[m->machno];
+		t = lcycles();
+		v->f(ureg, v->a);
+		t = lcycles() - t - (incycles[m->machno] - n);
+		incycles[m->machno] += t;
+		v->cycles[m->machno] += t;
+		if(t > v->maxcycles)
+			v->maxcycles = t;
+		coherence();
+		if(v->irq == IRQcntps || v->irq == IRQcntpns || v->irq == IRQresched)
+			clockintr = 1;
+	}
+	if(preempt){
+		splhi();
+		if(up != nil)
+			up->preempted = held;
+	}
+	if(intid >= 32 && stormmax != 0)
+		stormcheck(intid);
+	if(nstorm && clockintr && m->machno == 0)
+		stormrelease();
 	coherence();
-	cregs[GICC_EOIR] = intid;
+	cregs[GICC_EOIR] = iar;
+	if(--depth[m->machno] > 0){
+		if(clockintr)
+			nestclock[m->machno] = 1;
+		return 0;
+	}
+	exits[m->machno]++;
+	if(nestclock[m->machno]){
+		nestclock[m->machno] = 0;
+		clockintr = 1;
+	}
+	/* a handler readied a process, get it running somewhere */
+	if(nrdy > rdy && kick())
+		clockintr = 1;
 	return clockintr;
 }
 
@@ -206,12 +426,162 @@ fiq(Ureg *ureg)
 	cregs[GICC_EOIR] = intid;
 }
 
+static void
+settarget(u32int intid, int cpu)
+{
+	u32int t;
+	int s;
+
+	s = (intid%4) << 3;
+	t = dregs[GICD_TARGETSR0 + (intid/4)];
+	dregs[GICD_TARGETSR0 + (intid/4)] = (t & ~(0xFF << s)) | (1<<cpu) << s;
+	coherence();
+	route[intid].cpu = cpu;
+}
+
+static void
+setprio(u32int intid, int prio)
+{
+	u32int p;
+	int s;
+
+	s = (intid%4) << 3;
+	p = dregs[GICD_IPRIORITYR0 + (intid/4)];
+	dregs[GICD_IPRIORITYR0 + (intid/4)] = (p & ~(0xFF << s)) | prio << s;
+	coherence();
+}
+
+static int
+defaultclass(int irq)
+{
+	int i;
+
+	for(i = 0; i < nelem(defclass); i++)
+		if(defclass[i].irq == irq)
+			return defclass[i].class;
+	return Iio;
+}
+
+/*
+ * Route an enabled shared interrupt to cpu for good,
+ * the balancer leaves it there.
+ */
+void
+intraffinity(int irq, int cpu)
+{
+	if(irq < 32 || irq >= Nintid || cpu < 0 || cpu >= conf.nmach)
+		return;
+	lock(&vctllock);
+	if(route[irq].used){
+		settarget(irq, cpu);
+		route[irq].pinned = 1;
+	}
+	unlock(&vctllock);
+}
+
+/*
+ * Put an interrupt in one of the priority classes, before
+ * or after it is enabled. Without it, the class comes from
+ * defclass.
+ */
+void
+intrprio(int irq, int class)
+{
+	if(irq < 0 || irq >= Nintid || class < 0 || class >= Niclass)
+		return;
+	lock(&vctllock);
+	iclass[irq] = class;
+	classset[irq] = 1;
+	if(dregs != nil)
+		setprio(irq, classprio[class]);
+	unlock(&vctllock);
+}
+
+static int
+threadpending(void *a)
+{
+	Vctl *v;
+
+	v = a;
+	return v->pending || v->done;
+}
+
+static void
+intrthread(void *a)
+{
+	Vctl *v;
+	u32int intid;
+
+	v = a;
+	intid = v->intid;
+	while(waserror())
+		;
+	for(;;){
+		sleep(&v->r, threadpending, v);
+		if(v->done)
+			break;
+		v->pending = 0;
+		coherence();
+		if(v->dead)
+			continue;
+		v->f(nil, v->a);
+		lock(&vctllock);
+		if(!v->dead && !storm[intid].masked)
+			dregs[GICD_ISENABLER0 + (intid/32)] = 1 << (intid%32);
+		coherence();
+		unlock(&vctllock);
+	}
+	poperror();
+	v->exited = 1;
+	pexit("", 1);
+}
+
+static void
+threadstart(Vctl *v)
+{
+	if(up == nil)
+		return;	/* intrthreads will */
+	qlock(&threadlock);
+	if(!v->started){
+		v->started = 1;
+		kproc(v->name, intrthread, v);
+	}
+	qunlock(&threadlock);
+}
+
+/*
+ * Start the kprocs of threaded handlers enabled before
+ * there were processes, called from init0.
+ */
 void
-intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
+intrthreads(void)
 {
 	Vctl *v;
+	int i;
+
+	for(i = 32; i < Nintid; i++)
+		for(v = vspi[i]; v != nil; v = v->next)
+			if(v->threaded)
+				threadstart(v);
+}
+
+/*
+ * With IRQthread or'ed into irq, f runs in a kproc of its own,
+ * with a nil Ureg. The interrupt itself only masks the source
+ * and wakes the kproc, which unmasks it again once f returns,
+ * so f may sleep or wait on a bus. Only for shared interrupts;
+ * sharers of the source are held off while f runs.
+ *
+ * With IRQnest, f may be interrupted by a higher class, so it
+ * must ilock anything it shares with other handlers. A source
+ * nests only when all of its handlers asked to.
+ */
+void
+intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char *name)
+{
+	Vctl *v, **l;
 	u32int intid;
-	int cpu, prio;
+	int cpu, prio, threaded, nest;
 
 //	if(BUSTYPE(tbdf) == BusPCI){
 //		pciintrenable(tbdf, f, a);
@@ -220,9 +590,20 @@ intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 	if(tbdf != BUSUNKNOWN)
 		return;
 
+	threaded = nest = 0;
+	if(irq != IRQfiq){
+		threaded = (irq & IRQthread) != 0;
+		nest = (irq & IRQnest) != 0;
+		irq &= ~(IRQthread|IRQnest);
+	}
 	cpu = 0;
-	prio = 0x80;
 	intid = irq;
+	prio = classprio[Iio];
+	if(intid < Nintid){
+		if(!classset[intid])
+			iclass[intid] = defaultclass(irq);
+		prio = classprio[iclass[intid]];
+	}
 //	switch(irq){
 //	case IRQcntps:
 //		intid = 16 + 13;
@@ -249,6 +630,10 @@ intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 //	}
 	if(intid < 32)
 		cpu = m->machno;
+	if(irq != IRQfiq && intid >= Nintid){
+		print("intrenable: %s: no interrupt %d\n", name, irq);
+		return;
+	}
 
 	if((v = xalloc(sizeof(Vctl))) == nil)
 		panic("irqenable: no mem");
@@ -256,18 +641,28 @@ intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 	v->intid = intid;
 	v->f = f;
 	v->a = a;
+	v->threaded = threaded && intid >= 32;
+	v->nest = nest;
+	if(name != nil)
+		strncpy(v->name, name, KNAMELEN-1);
 
 	lock(&vctllock);
 	if(irq == IRQfiq){
 		vfiq = v;
 		prio = 0;
 	}else{
-		v->next = vctl[cpu][intid%32];
-		vctl[cpu][intid%32] = v;
+		/* shared handlers run in the order they were enabled */
+		for(l = vlist(intid, cpu); *l != nil; l = &(*l)->next)
+			;
+		coherence();
+		*l = v;
+		coherence();
+		setnest(intid);
 	}
 
-	/* enable cpu interface */
+	/* enable cpu interface, the hardware clamps the binary point to its minimum */
 	cregs[GICC_PMR] = 0xFF;
+	cregs[GICC_BPR] = 0;
 	coherence();
 
 	cregs[GICC_CTLR] |= 1;
@@ -280,8 +675,15 @@ intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 	coherence();
 
 	/* setup */
-	dregs[GICD_IPRIORITYR0 + (intid/4)] |= prio << ((intid%4) << 3);
-	dregs[GICD_TARGETSR0 + (intid/4)] |= (1<<cpu) << ((intid%4) << 3);
+	setprio(intid, prio);
+	if(intid >= 32 && intid < Nintid){
+		/* a shared source keeps the cpu it was given */
+		if(route[intid].used)
+			cpu = route[intid].cpu;
+		route[intid].used = 1;
+		settarget(intid, cpu);
+	}else
+		dregs[GICD_TARGETSR0 + (intid/4)] |= (1<<cpu) << ((intid%4) << 3);
 	coherence();
 
 	/* turn on */
@@ -289,15 +691,85 @@ intrenable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 	coherence();
 
 	unlock(&vctllock);
+
+	if(v->threaded)
+		threadstart(v);
 }
 
+/*
+ * Remove a handler. The entry is unlinked at once, but only
+ * freed after every other cpu has been seen outside of irq(),
+ * as one may still be running it. The source is masked when
+ * its last handler goes, a private one only on this cpu.
+ */
 void
-intrdisable(int, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
+intrdisable(int irq, void (*f)(Ureg*, void*), void *a, int tbdf, char*)
 {
+	Vctl **l, *v;
+	u32int intid;
+	ulong seen[MAXMACH];
+	int i;
+
 //	if(BUSTYPE(tbdf) == BusPCI){
 //		pciintrdisable(tbdf, f, a);
 //		return;
 //	}
+	if(tbdf != BUSUNKNOWN)
+		return;
+	if(irq != IRQfiq)
+		irq &= ~(IRQthread|IRQnest);
+	intid = irq;
+	if(irq != IRQfiq && intid >= Nintid)
+		return;
+
+	lock(&vctllock);
+	if(irq == IRQfiq){
+		v = vfiq;
+		if(v != nil && v->f == f && v->a == a)
+			vfiq = nil;
+		else
+			v = nil;
+	}else{
+		for(l = vlist(intid, m->machno); (v = *l) != nil; l = &v->next)
+			if(v->f == f && v->a == a)
+				break;
+		if(v != nil){
+			*l = v->next;
+			v->dead = 1;
+			setnest(intid);
+			if(*vlist(intid, m->machno) == nil){
+				dregs[GICD_ICENABLER0 + (intid/32)] = 1 << (intid%32);
+				if(intid >= 32)
+					route[intid].used = 0;
+			}
+		}
+	}
+	coherence();
+	unlock(&vctllock);
+	if(v == nil)
+		return;
+
+	for(i = 0; i < conf.nmach; i++)
+		seen[i] = exits[i];
+	for(i = 0; i < conf.nmach; i++)
+		if(i != m->machno)
+			while(depth[i] > 0 && exits[i] == seen[i])
+				microdelay(1);
+
+	/* a threaded handler may be running, wait for its kproc to go */
+	if(v->threaded && v->started){
+		v->done = 1;
+		coherence();
+		wakeup(&v->r);
+		if(up == nil || depth[m->machno] > 0)
+			return;
+		while(!v->exited)
+			tsleep(&up->sleep, return0, nil, 10);
+	}
+
+	/* called from a handler, this cpu may still be walking the list */
+	if(depth[m->machno] == 0)
+		xfree(v);
 }
 
 
@@ -319,3 +791,467 @@ isintractive(int intid)
 	return (dregs[GICD_ISACTIVER0 + (intid/32)] & (1 << (intid%32)));
 }
 
+
+static ulong
+intrcount(u32int intid)
+{
+	Vctl *v;
+	ulong n;
+	int i;
+
+	n = 0;
+	for(v = vspi[intid]; v != nil; v = v->next)
+		for(i = 0; i < MAXMACH; i++)
+			n += v->count[i];
+	return n;
+}
+
+static char*
+intrname(u32int intid)
+{
+	Vctl *v;
+
+	v = vspi[intid];
+	if(v != nil)
+		return v->name;
+	return "";
+}
+
+static void
+balance(void)
+{
+	ulong load[MAXMACH], n;
+	int order[Nintid], no, i, j, t, c, best;
+	Route *r;
+
+	memset(load, 0, sizeof load);
+	no = 0;
+	for(i = 32; i < Nintid; i++){
+		r = &route[i];
+		if(!r->used)
+			continue;
+		n = intrcount(i);
+		r->rate = n - r->last;
+		r->last = n;
+		if(r->pinned || r->rate < Balancemin)
+			load[r->cpu] += r->rate;
+		else
+			order[no++] = i;
+	}
+
+	/* busiest first */
+	for(i = 1; i < no; i++)
+		for(j = i; j > 0 && route[order[j]].rate > route[order[j-1]].rate; j--){
+			t = order[j];
+			order[j] = order[j-1];
+			order[j-1] = t;
+		}
+
+	for(i = 0; i < no; i++){
+		r = &route[order[i]];
+		best = 0;
+		for(c = 0; c < conf.nmach; c++)
+			if(active.machs[c] && load[c] < load[best])
+				best = c;
+		/* only move for a clear gain */
+		if(load[best] + r->rate/4 >= load[r->cpu] || !active.machs[best])
+			best = r->cpu;
+		load[best] += r->rate;
+		if(best != r->cpu){
+			lock(&vctllock);
+			settarget(order[i], best);
+			unlock(&vctllock);
+		}
+	}
+}
+
+static void
+balanceproc(void*)
+{
+	for(;;){
+		tsleep(&up->sleep, return0, nil, Balanceperiod);
+		if(balancing)
+			balance();
+	}
+}
+
+long
+intrctlread(Chan*, void *a, long n, vlong offset)
+{
+	char *p;
+	int i, l;
+	Route *r;
+
+	p = smalloc(READSTR);
+	l = snprint(p, READSTR, "balance %s\n", balancing ? "on" : "off");
+	l += snprint(p+l, READSTR-l, "storm %lud\n", stormmax);
+	for(i = 32; i < Nintid; i++){
+		r = &route[i];
+		if(!r->used)
+			continue;
+		l += snprint(p+l, READSTR-l, "%d cpu %d %s prio %s%s rate %lud storms %lud%s %s\n",
+			i, r->cpu, r->pinned ? "pinned" : "auto", classname[iclass[i]],
+			nestok[i] && iclass[i] >= Iio ? " nest" : "",
+			r->rate, storm[i].storms, storm[i].masked ? " masked" : "",
+			intrname(i));
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+long
+intrctlwrite(Chan*, void *a, long n, vlong)
+{
+	Cmdbuf *cb;
+	Route *r;
+	int irq, cpu, class;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf < 2)
+		error(Ebadctl);
+	if(strcmp(cb->f[0], "affinity") == 0){
+		/* affinity irq cpu|auto */
+		if(cb->nf != 3)
+			error(Ebadarg);
+		irq = atoi(cb->f[1]);
+		if(irq < 32 || irq >= Nintid || !route[irq].used)
+			error("no such shared interrupt");
+		r = &route[irq];
+		if(strcmp(cb->f[2], "auto") == 0)
+			r->pinned = 0;
+		else{
+			cpu = atoi(cb->f[2]);
+			if(cpu < 0 || cpu >= conf.nmach || !active.machs[cpu])
+				error("no such cpu");
+			intraffinity(irq, cpu);
+		}
+	}else if(strcmp(cb->f[0], "prio") == 0){
+		/* prio irq clock|net|io|slow */
+		if(cb->nf != 3)
+			error(Ebadarg);
+		irq = atoi(cb->f[1]);
+		if(irq < 0 || irq >= Nintid)
+			error("no such interrupt");
+		for(class = 0; class < Niclass; class++)
+			if(strcmp(cb->f[2], classname[class]) == 0)
+				break;
+		if(class == Niclass)
+			error("no such priority class");
+		intrprio(irq, class);
+	}else if(strcmp(cb->f[0], "storm") == 0){
+		/* storm count, interrupts per window, 0 turns it off */
+		stormmax = strtoul(cb->f[1], nil, 0);
+	}else if(strcmp(cb->f[0], "balance") == 0){
+		/* balance on|off */
+		balancing = strcmp(cb->f[1], "on") == 0;
+		if(balancing && !balancer){
+			balancer = 1;
+			kproc("irqbalance", balanceproc, nil);
+		}
+	}else
+		error(Ebadctl);
+	free(cb);
+	poperror();
+	return n;
+}
+
+static void
+sgisend(int sgi, ulong cpus)
+{
+	coherence();
+	dregs[GICD_SGIR] = (cpus & 0xFF) << 16 | sgi;
+	coherence();
+}
+
+/*
+ * A process was made ready by an interrupt handler. Preempt
+ * this cpu if the process outranks the one running, otherwise
+ * poke an idle cpu, or the one running the least important
+ * process, to look at the run queues. The target decides for
+ * itself in reschedintr. The port ready() has no hook for a
+ * process readied outside an interrupt: idle cpus leave
+ * idlewait when nrdy is written, busy ones see it at their
+ * next tick.
+ */
+static int
+kick(void)
+{
+	Proc *p;
+	int i, best, pri;
+
+	if(up == nil)
+		return 0;	/* idle, runproc will find it */
+	if(up->state == Running && anyhigher()){
+		up->delaysched++;
+		return 1;
+	}
+	best = -1;
+	pri = 0;
+	for(i = 0; i < conf.nmach; i++){
+		if(i == m->machno || !sgion[i])
+			continue;
+		p = MACHP(i)->proc;
+		if(p == nil){
+			best = i;
+			break;
+		}
+		if(best < 0 || p->priority < pri){
+			best = i;
+			pri = p->priority;
+		}
+	}
+	if(best >= 0)
+		sgisend(IRQresched, 1<<best);
+	return 0;
+}
+
+/* irq() returns true for IRQresched, so trap will sched */
+static void
+reschedintr(Ureg*, void*)
+{
+	if(up != nil && up->state == Running && anyhigher())
+		up->delaysched++;
+}
+
+static void
+callintr(Ureg*, void*)
+{
+	if(callwait[m->machno] == 0)
+		return;
+	call.f(call.a);
+	coherence();
+	callwait[m->machno] = 0;
+}
+
+/* with interrupts off; calls f(a) on cpus, returns without waiting */
+static void
+callstart(ulong cpus, void (*f)(void*), void *a)
+{
+	int i;
+
+	/* another cpu may be waiting for us while we wait for the lock */
+	while(!canlock(&calllock))
+		callintr(nil, nil);
+	call.f = f;
+	call.a = a;
+	for(i = 0; i < conf.nmach; i++)
+		if(cpus & 1<<i)
+			callwait[i] = 1;
+	sgisend(IRQcall, cpus);
+}
+
+static void
+callend(void)
+{
+	int i;
+
+	for(i = 0; i < conf.nmach; i++)
+		while(callwait[i])
+			microdelay(1);
+	unlock(&calllock);
+}
+
+/*
+ * Run f(a) at interrupt level on cpu, or on all other cpus
+ * if cpu is -1, and wait for it to finish. Must not be called
+ * holding a lock that f or an interrupted cpu might want.
+ */
+void
+sgicall(int cpu, void (*f)(void*), void *a)
+{
+	ulong cpus;
+	int i, s;
+
+	s = splhi();
+	if(cpu == m->machno){
+		f(a);
+		splx(s);
+		return;
+	}
+	cpus = 0;
+	for(i = 0; i < conf.nmach; i++)
+		if(i != m->machno && sgion[i] && (cpu < 0 || cpu == i))
+			cpus |= 1<<i;
+	if(cpus != 0){
+		callstart(cpus, f, a);
+		callend();
+	}
+	splx(s);
+}
+
+/*
+ * sgicall in two halves, for when the caller has to work
+ * with f while it runs: sgipost starts f(a) on another cpu
+ * and returns 0 if it cannot, sgiwait waits for it to finish.
+ * Both with interrupts off.
+ */
+int
+sgipost(int cpu, void (*f)(void*), void *a)
+{
+	if(cpu < 0 || cpu >= conf.nmach || cpu == m->machno || !sgion[cpu])
+		return 0;
+	callstart(1<<cpu, f, a);
+	return 1;
+}
+
+void
+sgiwait(void)
+{
+	callend();
+}
+
+/*
+ * Enable the software generated interrupts on this cpu,
+ * called by each cpu as it comes up.
+ */
+void
+sgiinit(void)
+{
+	intrenable(IRQresched, reschedintr, nil, BUSUNKNOWN, "resched");
+	intrenable(IRQcall, callintr, nil, BUSUNKNOWN, "call");
+	coherence();
+	sgion[m->machno] = 1;
+}
+
+static int
+statline(char *p, int l, Vctl *v, int intid)
+{
+	Vctl *w;
+	ulong count[MAXMACH], max;
+	uvlong cycles;
+	int i, c;
+
+	for(i = 0; i < MAXMACH; i++)
+		count[i] = v->count[i];
+	cycles = 0;
+	for(i = 0; i < MAXMACH; i++)
+		cycles += v->cycles[i];
+	max = v->maxcycles;
+
+	/* a private interrupt has a handler on each cpu */
+	if(intid < 32)
+		for(c = 0; c < conf.nmach; c++)
+			for(w = vctl[c][intid]; w != nil; w = w->next)
+				if(w != v && w->f == v->f && w->a == v->a){
+					count[c] += w->count[c];
+					cycles += w->cycles[c];
+					if(w->maxcycles > max)
+						max = w->maxcycles;
+				}
+
+	l += snprint(p+l, READSTR-l, "%4d", intid);
+	for(i = 0; i < conf.nmach; i++)
+		l += snprint(p+l, READSTR-l, " %10lud", count[i]);
+	l += snprint(p+l, READSTR-l, " %12llud %8lud %s%s\n",
+		cycles / m->cpumhz, max / m->cpumhz, v->name,
+		v->threaded ? " thread" : "");
+	return l;
+}
+
+/* is v's handler also on an earlier cpu? */
+static int
+seenbefore(Vctl *v, int intid, int cpu)
+{
+	Vctl *w;
+	int c;
+
+	for(c = 0; c < cpu; c++)
+		for(w = vctl[c][intid]; w != nil; w = w->next)
+			if(w->f == v->f && w->a == v->a)
+				return 1;
+	return 0;
+}
+
+/*
+ * One line per handler: intid, interrupts taken on each cpu,
+ * µs spent in the handler, its longest run in µs and its name.
+ * Time in nested interrupts is charged to them, for threaded
+ * handlers only the time at interrupt level is counted.
+ */
+long
+intrstatread(Chan*, void *a, long n, vlong offset)
+{
+	Vctl *v;
+	char *p;
+	int i, c, l;
+
+	p = smalloc(READSTR);
+	l = 0;
+	lock(&vctllock);
+	for(i = 0; i < 32; i++)
+		for(c = 0; c < conf.nmach; c++)
+			for(v = vctl[c][i]; v != nil; v = v->next)
+				if(!seenbefore(v, i, c))
+					l = statline(p, l, v, i);
+	for(i = 32; i < Nintid; i++)
+		for(v = vspi[i]; v != nil; v = v->next)
+			l = statline(p, l, v, i);
+	unlock(&vctllock);
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static void
+stormcheck(u32int intid)
+{
+	Storm *s;
+	ulong now;
+
+	s = &storm[intid];
+	now = TK2MS(MACHP(0)->ticks);
+	if(now - s->start >= Stormwindow){
+		s->start = now;
+		s->n = 0;
+	}
+	if(++s->n < stormmax || s->masked)
+		return;
+
+	ilock(&stormlock);
+	dregs[GICD_ICENABLER0 + (intid/32)] = 1 << (intid%32);
+	coherence();
+	if(s->backoff != 0 && now - s->last < Stormforget){
+		s->backoff *= 2;
+		if(s->backoff > Stormbackmax)
+			s->backoff = Stormbackmax;
+	}else
+		s->backoff = Stormback;
+	s->last = now;
+	s->until = now + s->backoff;
+	s->masked = 1;
+	s->storms++;
+	nstorm++;
+	iunlock(&stormlock);
+	iprint("irq %ud %s: interrupt storm, masked for %lud ms\n",
+		intid, intrname(intid), s->backoff);
+}
+
+static void
+stormrelease(void)
+{
+	Storm *s;
+	ulong now;
+	int i;
+
+	now = TK2MS(MACHP(0)->ticks);
+	ilock(&stormlock);
+	for(i = 32; i < Nintid && nstorm > 0; i++){
+		s = &storm[i];
+		if(!s->masked || (long)(now - s->until) < 0)
+			continue;
+		s->masked = 0;
+		s->start = now;
+		s->n = 0;
+		nstorm--;
+		/* unless it was disabled meanwhile */
+		if(vspi[i] != nil)
+			dregs[GICD_ISENABLER0 + (i/32)] = 1 << (i%32);
+	}
+	coherence();
+	iunlock(&stormlock);
+}
@@ -0,0 +1,406 @@
+/*
+ *	Allwinner A64 high speed timer
+ *
+ *	A 56 bit down counter clocked from ahb1, 200MHz as
+ *	u-boot leaves it. There is one channel; it is both the
+ *	free running count and the one-shot event source.
+ *
+ *	The counter runs continuously. A segment of seg ticks
+ *	starts at epoch; hstmrticks is epoch+seg-current. To set
+ *	a deadline the interval is loaded with the distance to it
+ *	and reloaded, then put back to Maxticks so that once the
+ *	segment expires the counter carries on from there rather
+ *	than expiring again. The ticks between reading the count
+ *	and the reload taking effect are not seen by the counter;
+ *	hstmrlink measures them against the generic timer and
+ *	each rearm adds them back, so the count keeps time.
+ *
+ *	Hstimers are kept sorted on a list like the port Timers,
+ *	f is called from the interrupt. #P/hstmr reads the count
+ *	and sleeps a process until a deadline.
+ */
+
+#include "u.h"
+#include "../port/lib.h"
+#include "mem.h"
+#include "dat.h"
+#include "fns.h"
+#include "../port/error.h"
+#include "io.h"
+#include "ccu.h"
+
+#define Maxticks	((1ULL<<56)-1)
+
+enum {
+	Irqen		= 0x00,
+	Irqsta		= 0x04,
+	Ctl		= 0x10,
+	Intvlo		= 0x14,
+	Intvhi		= 0x18,
+	Curlo		= 0x1C,
+	Curhi		= 0x20,
+
+	/* Irqen, Irqsta */
+	Tmr0		= 1<<0,
+
+	/* Ctl */
+	Enable		= 1<<0,
+	Reload		= 1<<1,
+	Presshift	= 4,		/* divide by 1<<n, n < 5 */
+	Single		= 1<<7,
+
+	Minticks	= 64,		/* longer than a rearm takes */
+	Ncal		= 4096,		/* rearms to measure */
+};
+
+typedef struct Hsleep Hsleep;
+
+struct Hsleep {
+	Hstimer;
+	Rendez	r;
+	int	done;
+};
+
+static struct {
+	Lock;
+	ulong	hz;
+	uvlong	epoch;
+	uvlong	seg;
+	uvlong	rearm;		/* ticks lost by each reload */
+	Hstimer	*head;
+	Hstimer	*running;	/* its f is being called */
+	int	runmach;
+} hs;
+
+static u32int
+hsrd(int reg)
+{
+	return *IO(u32int, HSTMR + reg);
+}
+
+static void
+hswr(int reg, u32int val)
+{
+	*IO(u32int, HSTMR + reg) = val;
+}
+
+static void
+setintv(uvlong v)
+{
+	hswr(Intvlo, v);
+	hswr(Intvhi, v>>32);
+}
+
+static uvlong
+current(void)
+{
+	u32int hi, lo;
+
+	do{
+		hi = hsrd(Curhi);
+		lo = hsrd(Curlo);
+	}while(hsrd(Curhi) != hi);
+	return (uvlong)(hi & 0xFFFFFF)<<32 | lo;
+}
+
+/*
+ * called ilocked. With the interrupt pending the segment
+ * has expired and the counter is on its way down from
+ * Maxticks, which the interrupt has yet to add to epoch.
+ */
+static uvlong
+now(void)
+{
+	uvlong c;
+
+	for(;;){
+		if(hsrd(Irqsta) & Tmr0){
+			c = current();
+			return hs.epoch + hs.seg + Maxticks - c;
+		}
+		c = current();
+		if((hsrd(Irqsta) & Tmr0) == 0)
+			return hs.epoch + hs.seg - c;
+	}
+}
+
+/* start a segment of d ticks, called ilocked */
+static void
+reload(uvlong d)
+{
+	uvlong t;
+	int i;
+
+	setintv(d);
+	t = now();
+	hswr(Ctl, Enable|Reload);
+	for(i = 0; i < 1000 && (hsrd(Ctl) & Reload) != 0; i++)
+		;
+	hs.epoch = t + hs.rearm;
+	hs.seg = d;
+	setintv(Maxticks);
+}
+
+/*
+ * end the segment at when, if that is sooner. Called
+ * ilocked; with the interrupt pending it is left to
+ * hstmrintr, which looks at the list again.
+ */
+static void
+arm(uvlong when)
+{
+	uvlong t, d;
+
+	if(hsrd(Irqsta) & Tmr0)
+		return;
+	t = now();
+	d = Minticks;
+	if(when > t + Minticks)
+		d = when - t;
+	if(t + d >= hs.epoch + hs.seg)
+		return;
+	reload(d);
+}
+
+/*
+ * the ticks a reload loses, from Ncal of them timed by the
+ * generic timer. Called before the interrupt is enabled.
+ */
+static void
+calibrate(ulong hz)
+{
+	uvlong f0, f1, fhz, t0, t1, real;
+	int i;
+
+	ilock(&hs);
+	hs.rearm = 0;
+	f0 = fastticks(&fhz);
+	t0 = now();
+	for(i = 0; i < Ncal; i++)
+		reload(hz);
+	t1 = now();
+	f1 = fastticks(nil);
+	real = (f1 - f0) * hz / fhz;
+	if(real > t1 - t0)
+		hs.rearm = (real - (t1 - t0)) / Ncal;
+	reload(Maxticks);
+	iunlock(&hs);
+}
+
+static void
+hstmrintr(Ureg *ur, void*)
+{
+	Hstimer *h;
+
+	ilock(&hs);
+	if((hsrd(Irqsta) & Tmr0) == 0){
+		iunlock(&hs);
+		return;
+	}
+	hswr(Irqsta, Tmr0);
+	hs.epoch += hs.seg;
+	hs.seg = Maxticks;
+	while((h = hs.head) != nil){
+		if(h->when > now()){
+			arm(h->when);
+			break;
+		}
+		hs.head = h->next;
+		h->on = 0;
+		hs.running = h;
+		hs.runmach = m->machno;
+		iunlock(&hs);
+		(*h->f)(ur, h);
+		ilock(&hs);
+		hs.running = nil;
+	}
+	iunlock(&hs);
+}
+
+ulong
+hstmrfreq(void)
+{
+	return hs.hz;
+}
+
+uvlong
+hstmrticks(void)
+{
+	uvlong t;
+
+	ilock(&hs);
+	t = now();
+	iunlock(&hs);
+	return t;
+}
+
+uvlong
+hstmrns(uvlong t)
+{
+	if(hs.hz == 0)
+		return 0;
+	return t/hs.hz*1000000000ULL + t%hs.hz*1000000000ULL/hs.hz;
+}
+
+uvlong
+hstmrnsticks(uvlong ns)
+{
+	return ns/1000000000ULL*hs.hz + ns%1000000000ULL*hs.hz/1000000000ULL;
+}
+
+static void
+hsunlink(Hstimer *h)
+{
+	Hstimer **l;
+
+	for(l = &hs.head; *l != nil; l = &(*l)->next)
+		if(*l == h){
+			*l = h->next;
+			break;
+		}
+	h->on = 0;
+}
+
+/*
+ * call h->f at hstmrticks h->when, or as soon as may be
+ * if that has gone.
+ */
+void
+hstmradd(Hstimer *h)
+{
+	Hstimer **l;
+
+	if(hs.hz == 0)
+		panic("hstmradd: no timer");
+	ilock(&hs);
+	if(h->on)
+		hsunlink(h);
+	for(l = &hs.head; *l != nil; l = &(*l)->next)
+		if((*l)->when > h->when)
+			break;
+	h->next = *l;
+	*l = h;
+	h->on = 1;
+	if(hs.head == h)
+		arm(h->when);
+	iunlock(&hs);
+}
+
+/*
+ * on return h->f is not running and will not be called,
+ * unless from h->f itself.
+ */
+void
+hstmrdel(Hstimer *h)
+{
+	ilock(&hs);
+	if(h->on)
+		hsunlink(h);
+	iunlock(&hs);
+	while(hs.running == h && hs.runmach != m->machno)
+		coherence();
+}
+
+static void
+hswakeup(Ureg*, Hstimer *h)
+{
+	Hsleep *s;
+
+	s = h->a;
+	s->done = 1;
+	wakeup(&s->r);
+}
+
+static int
+hsdone(void *a)
+{
+	return ((Hsleep*)a)->done;
+}
+
+/*
+ * sleep until hstmrticks reaches when. Taking the absolute
+ * time lets a caller keep a period without drift.
+ */
+void
+hstmrsleep(uvlong when)
+{
+	Hsleep s;
+
+	if(hs.hz == 0)
+		error("no high speed timer");
+	memset(&s, 0, sizeof s);
+	s.when = when;
+	s.f = hswakeup;
+	s.a = &s;
+	hstmradd(&s);
+	if(waserror()){
+		hstmrdel(&s);
+		nexterror();
+	}
+	sleep(&s.r, hsdone, &s);
+	poperror();
+	hstmrdel(&s);
+}
+
+static long
+hstmrread(Chan*, void *a, long n, vlong offset)
+{
+	char buf[3*21+1];
+	uvlong t;
+
+	t = hstmrticks();
+	snprint(buf, sizeof buf, "%20llud %20llud %20lud\n", t, hstmrns(t), hs.hz);
+	return readstr(offset, a, n, buf);
+}
+
+static long
+hstmrwrite(Chan*, void *a, long n, vlong)
+{
+	Cmdbuf *cb;
+	uvlong v;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf != 2)
+		error(Ebadctl);
+	v = strtoull(cb->f[1], nil, 0);
+	if(strcmp(cb->f[0], "sleep") == 0)
+		hstmrsleep(hstmrticks() + hstmrnsticks(v));
+	else if(strcmp(cb->f[0], "until") == 0)
+		hstmrsleep(v);
+	else
+		error(Ebadctl);
+	free(cb);
+	poperror();
+	return n;
+}
+
+void
+hstmrlink(void)
+{
+	ulong hz;
+
+	hz = getclkrate(AHB1_APB1_CFG_REG);
+	if(hz == 0){
+		print("hstmr: ahb1 clock unknown\n");
+		return;
+	}
+	if(openthegate("HSTMR") < 0){
+		print("hstmr: no gate\n");
+		return;
+	}
+	hswr(Ctl, 0);
+	hswr(Irqsta, Tmr0);
+	setintv(Maxticks);
+	hswr(Ctl, Enable|Reload|0<<Presshift);
+	hs.epoch = 0;
+	hs.seg = Maxticks;
+	calibrate(hz);
+	hswr(Irqen, Tmr0);
+	intrenable(IRQtimerhs, hstmrintr, nil, BUSUNKNOWN, "hstmr");
+	hs.hz = hz;
+	addarchfile("hstmr", 0666, hstmrread, hstmrwrite);
+}
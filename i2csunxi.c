@@ -248,14 +248,14 @@ pincfg(void)
 static int
 i2cwait(Ctlr *ctlr, u32int state)
 {
-	int timeout = 100;
+	int timeout = 10000;	/* polls of 100µs */
 	u32int reg;
 	while((reg = twird(ctlr, TWI_STAT)) != state) {
 		if(state == STAT_IDLE && reg == 0xf9) break;
 		if(timeout-- < 0){
 			return 0;
 		}
-		tsleep(&ctlr->r, return0, nil, 100);
+		utsleep(&ctlr->r, return0, nil, 100);
 		DEBUG iprint("i2c waiting state %x got %x\n", state, reg);
 		dump_regs(ctlr);
 	}
@@ -312,7 +312,8 @@ init(I2Cbus *bus)
 	qlock(ctlr);
 	i2crst(ctlr);
 	qunlock(ctlr);
-	intrenable(ctlr->irq, twiinterrupt, ctlr, BUSUNKNOWN, bus->name);
+	/* twiinterrupt only sets ack and wakes the caller, safe to nest */
+	intrenable(ctlr->irq|IRQnest, twiinterrupt, ctlr, BUSUNKNOWN, bus->name);
 
 	return 0;
 }
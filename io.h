@@ -27,6 +27,7 @@
 #define	CCUBASE		0x01C20000
 
 #define TIMER		0x20C00
+#define HSTMR		0x01C60000
 #define KEYADC		0x1C21800
 
 
@@ -76,9 +77,23 @@
 #define	PMICRTA		0x2d
 
 
+/* interrupt priority classes, highest first, see intrprio */
+enum {
+	Iclock		= 0,
+	Inet,
+	Iio,
+	Islow,
+	Niclass,
+};
+
 /* IRQs */
 enum {
 	IRQfiq		=	-1,
+	IRQthread	=	0x10000,	/* or'ed in, see intrenable */
+	IRQnest		=	0x20000,	/* or'ed in, see intrenable */
+
+	IRQresched	=	0,	/* software generated, see sgiinit */
+	IRQcall		=	1,
 
 	PPI		= 16,
 	SPI		= 32,
@@ -143,6 +158,9 @@ enum {
 	IRQpmu		=	SPI+101,
 	IRQpp1		=	SPI+102,
 	IRQppmmu1	=	SPI+103,
+
+	/* cortex-a53 pmu, one for each cpu */
+	IRQcpupmu	=	SPI+152,
 };
 
 #define BUSUNKNOWN (-1)
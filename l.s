@@ -322,7 +322,12 @@ TEXT splx(SB), 1, $-4
 	MSR	R0, DAIF
 	RETURN
 
-TEXT idlehands(SB), 1, $-4
+TEXT wfe(SB), 1, $-4
+	WFE
+	RETURN
+
+/* wait for an interrupt or a change of nrdy */
+TEXT idlewait(SB), 1, $-4
 	DMB	$ISH
 	MOV	$nrdy(SB), R1
 	LDXRW	(R1), R0
@@ -158,6 +158,8 @@ init0(void)
 		setconfenv();
 		poperror();
 	}
+	intrthreads();
+	skewcheck();
 	kproc("alarm", alarmkproc, 0);
 
 	sp = (char**)(USTKTOP-sizeof(Tos) - 8 - sizeof(sp[0])*4);
@@ -177,6 +179,15 @@ confinit(void)
 
 	conf.nmach = MAXMACH;
 
+	conf.hz = 100;
+	if(p = getconf("*hz")){
+		i = strtol(p, 0, 0);
+		if(i >= 100 && i <= 1000 && 1000 % i == 0)
+			conf.hz = i;
+		else
+			print("*hz=%s ignored, must divide 1000\n", p);
+	}
+
 	if(p = getconf("service")){
 		if(strcmp(p, "cpu") == 0)
 			cpuserver = 1;
@@ -276,9 +287,10 @@ main(void)
 		fpuinit();
 	//	intrinit();
 		clockinit();
+		sgiinit();
 		cpuidprint();
 		synccycles();
-		timersinit();
+		hzinit();
 		flushtlb();
 		mmu1init();
 		m->ticks = MACHP(0)->ticks;
@@ -299,6 +311,7 @@ main(void)
 	fpuinit();
 //	intrinit();
 	clockinit();
+	sgiinit();
 	cpuidprint();
 	timersinit();
 	pageinit();
@@ -314,11 +327,38 @@ main(void)
 	schedinit();
 }
 
+static void (*shutdownfns[8])(void);
+static int nshutdown;
+
+/*
+ * f is called once, by the first of exit and reboot, before
+ * the other cpus are stopped. It may be at splhi after a panic.
+ */
+void
+addshutdown(void (*f)(void))
+{
+	if(nshutdown < nelem(shutdownfns))
+		shutdownfns[nshutdown++] = f;
+}
+
+static void
+shutdownall(void)
+{
+	static int once;
+	int i;
+
+	if(tas(&once) != 0)
+		return;
+	for(i = 0; i < nshutdown; i++)
+		(*shutdownfns[i])();
+}
+
 void
 exit(int)
 {
 	Ureg u = { .r0 = 0x84000002 };	/* CPU_OFF */
 
+	shutdownall();
 	cpushutdown();
 	splfhi();
 
@@ -353,6 +393,7 @@ void
 reboot(void*, void *code, ulong size)
 {
 	writeconf();
+	shutdownall();
 	while(m->machno != 0){
 		procwired(up, 0);
 		sched();
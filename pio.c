@@ -213,6 +213,23 @@ int pioset(char *name, int on)
 	return 0;
 }
 
+/* the pull registers follow the data and drive registers of each port */
+int piopull(char *name, int pull)
+{
+	PioPin *p = findpio(name);
+	u32int reg;
+	int off, preg;
+
+	if(p == nil) return -1;
+	preg = p->datareg + 0xc + (p->dataoff/16)*4;
+	off = (p->dataoff%16)*2;
+	reg = *IO(u32int, p->memio + preg);
+	reg &= ~(0x3 << off);
+	reg |= pull<<off;
+	*IO(u32int, p->memio + preg) = reg;
+	return 0;
+}
+
 int pioget(char *name)
 {
 	PioPin *p = findpio(name);
@@ -7,6 +7,12 @@ enum {
 	PioInterrupt	= 6,
 };
 
+enum {
+	PioPullNone	= 0,
+	PioPullUp	= 1,
+	PioPullDown	= 2,
+};
+
 enum {
 	PioEIntPos = 0,
 	PioEIntNeg = 1,
@@ -0,0 +1,545 @@
+/*
+ *	Cortex-A53 Performance Monitors
+ *	ARM DDI 0500, chapter 12
+ *
+ *	The A64 gives the overflow interrupt of each cpu an SPI
+ *	of its own. Event counter Cprof samples the pc every
+ *	period events; #P/pmuctl sets it up and #P/pmuprof
+ *	returns the samples, a line each: cpu, pid, k or u, pc.
+ *	The cycle counter is left running for lcycles.
+ *
+ *	Event counters 0 to Npmuctr-1 belong to the process
+ *	running, set up from #P/pmuctr. procsave and procrestore,
+ *	wrapped in trap.c, switch them along with the fpu, so a
+ *	process reading PMEVCNTR<n>_EL0 sees its own counts; the
+ *	64 bit totals are kept in its PMMU.
+ */
+
+#include "u.h"
+#include "../port/lib.h"
+#include "mem.h"
+#include "dat.h"
+#include "fns.h"
+#include "../port/error.h"
+#include "io.h"
+#include "ureg.h"
+#include "../arm64/sysreg.h"
+
+#ifndef PMCNTENCLR_EL0
+#define PMCNTENCLR_EL0		SYSREG(3,3,9,12,2)
+#endif
+#ifndef PMOVSCLR_EL0
+#define PMOVSCLR_EL0		SYSREG(3,3,9,12,3)
+#endif
+#ifndef PMINTENSET_EL1
+#define PMINTENSET_EL1		SYSREG(3,0,9,14,1)
+#endif
+#ifndef PMINTENCLR_EL1
+#define PMINTENCLR_EL1		SYSREG(3,0,9,14,2)
+#endif
+#define PMEVCNTR(n)		SYSREG(3,3,14,8+((n)>>3),(n)&7)
+#define PMEVTYPER(n)		SYSREG(3,3,14,12+((n)>>3),(n)&7)
+
+enum {
+	Cprof		= 5,		/* the last event counter */
+	Nsample		= 8192,		/* per cpu */
+	Defperiod	= 1000000,
+	Minperiod	= 10000,
+
+	/* PMEVTYPER */
+	Nokernel	= 1<<31,
+	Nouser		= 1<<30,
+
+	Procmask	= (1<<Npmuctr)-1,
+};
+
+typedef struct Sample Sample;
+typedef struct Sbuf Sbuf;
+
+struct Sample {
+	uintptr	pc;
+	ulong	pid;
+	int	user;
+};
+
+/* one writer, the pmu interrupt of its cpu */
+struct Sbuf {
+	Sample	*s;
+	ulong	rd;
+	ulong	wr;
+	ulong	taken;
+	ulong	lost;
+};
+
+static struct {
+	QLock;
+	int	on;
+	int	event;
+	u32int	period;
+	u32int	filter;
+	Sbuf	buf[MAXMACH];
+} prof;
+
+static struct {
+	char	*name;
+	int	event;
+} events[] = {
+	"cycles",	0x11,
+	"insts",	0x08,
+	"l1imiss",	0x01,
+	"itlbmiss",	0x02,
+	"l1dmiss",	0x03,
+	"l1d",		0x04,
+	"dtlbmiss",	0x05,
+	"exc",		0x09,
+	"brmiss",	0x10,
+	"br",		0x12,
+	"mem",		0x13,
+	"l2d",		0x16,
+	"l2dmiss",	0x17,
+	"bus",		0x19,
+};
+
+static Lock pmulock;
+static Proc *owner[MAXMACH];	/* whose counters are loaded */
+
+/* an event by name or number, -1 if neither */
+static int
+pmuevent(char *s)
+{
+	char *e;
+	int i, n;
+
+	for(i = 0; i < nelem(events); i++)
+		if(strcmp(s, events[i].name) == 0)
+			return events[i].event;
+	n = strtol(s, &e, 0);
+	if(*e != 0 || n < 0 || n > 0x3FF)
+		return -1;
+	return n;
+}
+
+static char*
+pmuname(int event, char *buf, int n)
+{
+	int i;
+
+	for(i = 0; i < nelem(events); i++)
+		if(events[i].event == event)
+			return events[i].name;
+	snprint(buf, n, "%#x", event);
+	return buf;
+}
+
+/* a process counter wrapped */
+static void
+carry(u32int ovf)
+{
+	Proc *p;
+	int i;
+
+	p = owner[m->machno];
+	if(p == nil || p != up || p->pmudirty)
+		return;
+	for(i = 0; i < p->pmun; i++)
+		if(ovf & 1<<i)
+			p->pmuval[i] += 1ULL<<32;
+}
+
+static void
+pmuintr(Ureg *ureg, void*)
+{
+	Sbuf *b;
+	Sample *s;
+	u32int ovf;
+
+	ovf = sysrd(PMOVSCLR_EL0);
+	syswr(PMOVSCLR_EL0, ovf);
+	if(ovf & Procmask)
+		carry(ovf);
+	if((ovf & 1<<Cprof) == 0 || !prof.on)
+		return;
+	syswr(PMEVCNTR(Cprof), -prof.period);
+	b = &prof.buf[m->machno];
+	b->taken++;
+	if(b->wr - b->rd >= Nsample){
+		b->lost++;
+		return;
+	}
+	s = &b->s[b->wr % Nsample];
+	s->pc = ureg->pc;
+	s->pid = up != nil ? up->pid : 0;
+	s->user = userureg(ureg);
+	coherence();
+	b->wr++;
+}
+
+static void
+profstart(void*)
+{
+	syswr(PMCNTENCLR_EL0, 1<<Cprof);
+	syswr(PMEVTYPER(Cprof), prof.filter | prof.event);
+	syswr(PMEVCNTR(Cprof), -prof.period);
+	syswr(PMOVSCLR_EL0, 1<<Cprof);
+	syswr(PMINTENSET_EL1, 1<<Cprof);
+	syswr(PMCNTENSET, 1<<Cprof);
+}
+
+static void
+profstop(void*)
+{
+	syswr(PMCNTENCLR_EL0, 1<<Cprof);
+	syswr(PMINTENCLR_EL1, 1<<Cprof);
+	syswr(PMOVSCLR_EL0, 1<<Cprof);
+}
+
+static void
+everycpu(void (*f)(void*))
+{
+	int s;
+
+	s = splhi();
+	sgicall(-1, f, nil);
+	f(nil);
+	splx(s);
+}
+
+static char*
+modename(u32int filter)
+{
+	switch(filter){
+	case Nouser:
+		return "kernel";
+	case Nokernel:
+		return "user";
+	}
+	return "all";
+}
+
+static long
+pmuctlread(Chan*, void *a, long n, vlong offset)
+{
+	char *p, buf[16];
+	Sbuf *b;
+	int i, l;
+
+	p = smalloc(READSTR);
+	qlock(&prof);
+	l = snprint(p, READSTR, "%s event %s period %ud mode %s\n",
+		prof.on ? "on" : "off", pmuname(prof.event, buf, sizeof buf),
+		prof.period, modename(prof.filter));
+	for(i = 0; i < conf.nmach; i++){
+		b = &prof.buf[i];
+		l += snprint(p+l, READSTR-l, "cpu%d taken %lud lost %lud queued %lud\n",
+			i, b->taken, b->lost, b->wr - b->rd);
+	}
+	qunlock(&prof);
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static long
+pmuctlwrite(Chan*, void *a, long n, vlong)
+{
+	Cmdbuf *cb;
+	Sbuf *b;
+	ulong v;
+	int i;
+
+	cb = parsecmd(a, n);
+	qlock(&prof);
+	if(waserror()){
+		qunlock(&prof);
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf < 1)
+		error(Ebadctl);
+	if(strcmp(cb->f[0], "event") == 0 && cb->nf == 2){
+		if((i = pmuevent(cb->f[1])) < 0)
+			error("unknown event");
+		prof.event = i;
+	}else if(strcmp(cb->f[0], "period") == 0 && cb->nf == 2){
+		v = strtoul(cb->f[1], nil, 0);
+		if(v < Minperiod || v > 0x7FFFFFFF)
+			error(Ebadarg);
+		prof.period = v;
+	}else if(strcmp(cb->f[0], "mode") == 0 && cb->nf == 2){
+		if(strcmp(cb->f[1], "all") == 0)
+			prof.filter = 0;
+		else if(strcmp(cb->f[1], "kernel") == 0)
+			prof.filter = Nouser;
+		else if(strcmp(cb->f[1], "user") == 0)
+			prof.filter = Nokernel;
+		else
+			error(Ebadarg);
+	}else if(strcmp(cb->f[0], "start") == 0){
+		for(i = 0; i < conf.nmach; i++){
+			b = &prof.buf[i];
+			if(b->s == nil)
+				b->s = smalloc(Nsample*sizeof(Sample));
+		}
+		prof.on = 1;
+	}else if(strcmp(cb->f[0], "stop") == 0){
+		prof.on = 0;
+		everycpu(profstop);
+	}else if(strcmp(cb->f[0], "clear") == 0){
+		for(i = 0; i < conf.nmach; i++){
+			b = &prof.buf[i];
+			b->rd = b->wr;
+			b->taken = b->lost = 0;
+		}
+	}else
+		error(Ebadctl);
+	/* new settings take effect at once */
+	if(prof.on)
+		everycpu(profstart);
+	poperror();
+	qunlock(&prof);
+	free(cb);
+	return n;
+}
+
+/* takes the samples it returns */
+static long
+profread(Chan*, void *a, long n, vlong)
+{
+	char *buf, *p, *e;
+	Sample *s;
+	Sbuf *b;
+	int i;
+
+	if(n > 65536)
+		n = 65536;
+	buf = smalloc(n);
+	p = buf;
+	e = buf + n;
+	qlock(&prof);
+	for(i = 0; i < conf.nmach; i++){
+		b = &prof.buf[i];
+		if(b->s == nil)
+			continue;
+		while(b->rd != b->wr && e - p > 48){
+			s = &b->s[b->rd % Nsample];
+			p = seprint(p, e, "%d %lud %c %#p\n",
+				i, s->pid, s->user ? 'u' : 'k', s->pc);
+			coherence();
+			b->rd++;
+		}
+	}
+	qunlock(&prof);
+	n = p - buf;
+	memmove(a, buf, n);
+	free(buf);
+	return n;
+}
+
+/* called from procsave, interrupts off */
+void
+pmuprocsave(Proc *p)
+{
+	u32int ovf;
+	uvlong *v;
+	int i;
+
+	if(owner[m->machno] == nil)
+		return;
+	syswr(PMCNTENCLR_EL0, Procmask);
+	syswr(PMINTENCLR_EL1, Procmask);
+	ovf = sysrd(PMOVSCLR_EL0) & Procmask;
+	syswr(PMOVSCLR_EL0, ovf);
+	ilock(&pmulock);
+	/* unless it was given new events meanwhile */
+	if(owner[m->machno] == p && !p->pmudirty)
+		for(i = 0; i < p->pmun; i++){
+			v = &p->pmuval[i];
+			*v = (*v & ~0xFFFFFFFFULL) + (u32int)sysrd(PMEVCNTR(i));
+			if(ovf & 1<<i)
+				*v += 1ULL<<32;
+		}
+	iunlock(&pmulock);
+	/* PMUSERENR lets the next process read them */
+	for(i = 0; i < Npmuctr; i++)
+		syswr(PMEVCNTR(i), 0);
+	owner[m->machno] = nil;
+}
+
+/* called from procrestore, interrupts off */
+void
+pmuprocrestore(Proc *p)
+{
+	int i, n;
+
+	if(p->pmun == 0)
+		return;
+	ilock(&pmulock);
+	n = p->pmun;
+	for(i = 0; i < n; i++){
+		syswr(PMEVTYPER(i), p->pmuevt[i]);
+		syswr(PMEVCNTR(i), (u32int)p->pmuval[i]);
+	}
+	p->pmudirty = 0;
+	iunlock(&pmulock);
+	syswr(PMOVSCLR_EL0, Procmask);
+	syswr(PMINTENSET_EL1, (1<<n)-1);
+	syswr(PMCNTENSET, (1<<n)-1);
+	owner[m->machno] = p;
+}
+
+/* the child counts the same events, from zero */
+void
+pmuprocfork(Proc *p)
+{
+	int i;
+
+	ilock(&pmulock);
+	p->pmun = up->pmun;
+	for(i = 0; i < Npmuctr; i++){
+		p->pmuevt[i] = up->pmuevt[i];
+		p->pmuval[i] = 0;
+	}
+	p->pmudirty = 0;
+	iunlock(&pmulock);
+}
+
+void
+pmuprocsetup(Proc *p)
+{
+	p->pmun = 0;
+	p->pmudirty = 0;
+}
+
+static char*
+evtname(u32int evt, char *buf, int n)
+{
+	char *s, b[16];
+
+	s = pmuname(evt & 0x3FF, b, sizeof b);
+	switch(evt & (Nokernel|Nouser)){
+	case Nokernel:
+		snprint(buf, n, "%s:u", s);
+		break;
+	case Nouser:
+		snprint(buf, n, "%s:k", s);
+		break;
+	default:
+		snprint(buf, n, "%s", s);
+	}
+	return buf;
+}
+
+/*
+ * A line for each process with counters: pid, name and
+ * event=count, as of its last context switch.
+ */
+static long
+pmuctrread(Chan*, void *a, long n, vlong offset)
+{
+	char *p, buf[32];
+	Proc *pr;
+	int i, j, l;
+
+	p = smalloc(READSTR);
+	l = 0;
+	for(i = 0; i < conf.nproc && l < READSTR-128; i++){
+		pr = proctab(i);
+		if(pr->state == Dead || pr->pmun == 0)
+			continue;
+		l += snprint(p+l, READSTR-l, "%lud %s", pr->pid, pr->text);
+		ilock(&pmulock);
+		for(j = 0; j < pr->pmun; j++)
+			l += snprint(p+l, READSTR-l, " %s=%llud",
+				evtname(pr->pmuevt[j], buf, sizeof buf), pr->pmuval[j]);
+		iunlock(&pmulock);
+		l += snprint(p+l, READSTR-l, "\n");
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+/*
+ * pid event... counts the events for pid and the children it
+ * forks from then on, from zero; an event may end in :u or :k
+ * to count only in user or kernel mode. pid off stops it.
+ */
+static long
+pmuctrwrite(Chan*, void *a, long n, vlong)
+{
+	Cmdbuf *cb;
+	Proc *p;
+	u32int evt[Npmuctr];
+	char *s;
+	ulong pid;
+	int i, ne, e;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf < 2)
+		error(Ebadctl);
+	pid = strtoul(cb->f[0], nil, 0);
+	ne = 0;
+	if(strcmp(cb->f[1], "off") != 0){
+		if(cb->nf-1 > Npmuctr)
+			error("too many events");
+		for(i = 1; i < cb->nf; i++){
+			s = cb->f[i];
+			evt[ne] = 0;
+			if((s = strchr(s, ':')) != nil){
+				*s++ = 0;
+				if(strcmp(s, "u") == 0)
+					evt[ne] = Nokernel;
+				else if(strcmp(s, "k") == 0)
+					evt[ne] = Nouser;
+				else
+					error(Ebadarg);
+			}
+			if((e = pmuevent(cb->f[i])) < 0)
+				error("unknown event");
+			evt[ne++] |= e;
+		}
+	}
+
+	for(i = 0; i < conf.nproc; i++){
+		p = proctab(i);
+		if(p->pid == pid && p->state != Dead)
+			break;
+	}
+	if(i == conf.nproc)
+		error(Eprocdied);
+	if(p->kp || (strcmp(p->user, up->user) != 0 && !iseve()))
+		error(Eperm);
+
+	/* takes effect when p is next switched in */
+	ilock(&pmulock);
+	p->pmun = ne;
+	for(i = 0; i < ne; i++){
+		p->pmuevt[i] = evt[i];
+		p->pmuval[i] = 0;
+	}
+	p->pmudirty = 1;
+	iunlock(&pmulock);
+	free(cb);
+	poperror();
+	return n;
+}
+
+void
+pmulink(void)
+{
+	int i;
+
+	prof.event = pmuevent("cycles");
+	prof.period = Defperiod;
+	for(i = 0; i < conf.nmach; i++){
+		intrenable(IRQcpupmu+i, pmuintr, nil, BUSUNKNOWN, "pmu");
+		intraffinity(IRQcpupmu+i, i);
+	}
+	addarchfile("pmuctl", 0664, pmuctlread, pmuctlwrite);
+	addarchfile("pmuprof", 0444, profread, nil);
+	addarchfile("pmuctr", 0666, pmuctrread, pmuctrwrite);
+}
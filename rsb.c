@@ -87,18 +87,37 @@ rsbwr(int offset, u32int val)
 }
 
 
+/*
+ *	A transfer takes tens of µs, poll at about that rate:
+ *	sleeping when we can, spinning early in boot or with
+ *	interrupts off.
+ */
+enum {
+	Rsbpoll		= 20,		/* µs */
+	Rsbtimeout	= 10000,	/* polls */
+};
+
+static void
+rsbpause(void)
+{
+	if(up != nil && islo())
+		utsleep(&up->sleep, return0, nil, Rsbpoll);
+	else
+		microdelay(Rsbpoll);
+}
+
 static int
 rsbidle(void)
 {
 	u32int buf;
-	int timeout = 1000;
+	int timeout = Rsbtimeout;
 
 	while(timeout > 0){
 		buf = rsbrd(RSB_CTRL_REG);
 		if((buf & RSB_CTRL_START_TRANS) == 0)
 			return 1;
 		timeout--;
-		delay(10);
+		rsbpause();
 	}
 
 	/* not idle */
@@ -109,13 +128,13 @@ rsbidle(void)
 static int
 rsbwait(void)
 {
-	int timeout = 1000;
+	int timeout = Rsbtimeout;
 
 	while(timeout > 0){
 		if((rsbrd(RSB_PMCR_REG) & RSB_PMCR_PMU_SEND) == 0)
 			return 1;
 		timeout--;
-		delay(10);
+		rsbpause();
 	}
 	return 0;
 }
@@ -150,7 +169,7 @@ pokepmic(void)
 static int
 rsbreset(void)
 {
-	int timeout = 1000;
+	int timeout = Rsbtimeout;
 
 	rsbwr(RSB_CTRL_REG, RSB_CTRL_SOFT_RESET);
 
@@ -158,7 +177,7 @@ rsbreset(void)
 		if((rsbrd(RSB_CTRL_REG) & RSB_CTRL_SOFT_RESET) == 0)
 			break;
 		timeout--;
-		delay(10);
+		rsbpause();
 	}
 
 	if(timeout == 0){
@@ -376,7 +395,8 @@ rsbinit(void)
 	char *err;
 
 	iprint("init: RSB\n");
-	intrenable(IRQrsb, rsbinterrupt, nil, BUSUNKNOWN, "RSB");
+	/* rsbinterrupt touches only its own registers, safe to nest */
+	intrenable(IRQrsb|IRQnest, rsbinterrupt, nil, BUSUNKNOWN, "RSB");
 
 	arch_rsbsetup();
 
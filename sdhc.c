@@ -7,9 +7,11 @@
 #include "mem.h"
 #include "dat.h"
 #include "fns.h"
+#include "../port/error.h"
 #include "io.h"
 #include "../port/sd.h"
 #include "ccu.h"
+#include "pio.h"
 
 #define CTRL_REG	0x00
 #define		CTRL_FIFO_AC_MOD  (1<<31)
@@ -87,6 +89,7 @@
 #define		INT_CMD_DONE	INT_CC
 #define		INT_RE (1<<1)
 #define		INT_CMD_FAILED	INT_RE
+#define		INT_XFER_ERRORS	(INT_DEE|INT_DSE_BC|INT_FU_FO|INT_DTO_BDS|INT_RTO_BACK|INT_DCE|INT_RCE|INT_RE)
 
 #define STATUS_REG	0x3C
 #define		STATUS_DMA_REQ	(1<<31)
@@ -188,6 +191,338 @@ static struct IdmacChain {
 	u32int nextdes; // ptr to next Idmac descriptor
 };
 
+/* descriptors kept per controller, longer chains are allocated */
+enum {
+	Ndesc		= 64,
+};
+
+
+/* block commands, by index */
+enum {
+	CMDreadsingle	= 17,
+	CMDreadmulti	= 18,
+	CMDwritesingle	= 24,
+	CMDwritemulti	= 25,
+};
+
+/* R1 card status for a card idle in the transfer state */
+#define R1_TRAN_READY	(4<<9 | 1<<8)
+/* out of range, address, erase sequence/param, wp violation, erase skip */
+#define R1_ERRORS	(1<<31 | 1<<30 | 1<<28 | 1<<27 | 1<<26 | 1<<15)
+
+static SDiocmd SD_ERASE_START	= { .index = 32, .resp = 1, .name = "ERASE_WR_BLK_START" };
+static SDiocmd SD_ERASE_END	= { .index = 33, .resp = 1, .name = "ERASE_WR_BLK_END" };
+static SDiocmd MMC_ERASE_START	= { .index = 35, .resp = 1, .name = "ERASE_GROUP_START" };
+static SDiocmd MMC_ERASE_END	= { .index = 36, .resp = 1, .name = "ERASE_GROUP_END" };
+static SDiocmd ERASE_BLOCKS	= { .index = 38, .resp = 1, .busy = 1, .name = "ERASE" };
+static SDiocmd CARD_STATUS	= { .index = 13, .resp = 1, .name = "SEND_STATUS" };
+static SDiocmd MMC_SWITCH	= { .index = 6, .resp = 1, .busy = 1, .name = "SWITCH" };
+static SDiocmd SET_BLOCK_COUNT	= { .index = 23, .resp = 1, .name = "SET_BLOCK_COUNT" };
+static SDiocmd READ_BLOCKS	= { .index = CMDreadmulti, .resp = 1, .data = 3, .name = "READ_MULTIPLE_BLOCK" };
+static SDiocmd WRITE_BLOCKS	= { .index = CMDwritemulti, .resp = 1, .data = 4, .name = "WRITE_MULTIPLE_BLOCK" };
+static SDiocmd STOP_BLOCKS	= { .index = 12, .resp = 1, .busy = 1, .name = "STOP_TRANSMISSION" };
+static SDiocmd IO_SEND_OP_COND	= { .index = 5, .resp = 3, .name = "IO_SEND_OP_COND" };
+static SDiocmd IO_SEND_RCA	= { .index = 3, .resp = 1, .name = "SEND_RELATIVE_ADDR" };
+static SDiocmd IO_SELECT	= { .index = 7, .resp = 1, .busy = 1, .name = "SELECT_CARD" };
+static SDiocmd IO_RW_DIRECT	= { .index = 52, .resp = 1, .name = "IO_RW_DIRECT" };
+static SDiocmd IO_READ_EXTENDED	= { .index = 53, .resp = 1, .data = 1, .name = "IO_RW_EXTENDED" };
+static SDiocmd IO_WRITE_EXTENDED	= { .index = 53, .resp = 1, .data = 2, .name = "IO_RW_EXTENDED" };
+
+#define R1_SWITCH_ERROR	(1<<7)
+
+enum {
+	ERASE_ARG_TRIM		= 0x00000001,
+	ERASE_ARG_DISCARD	= 0x00000003,
+
+	Etrim			= 0,
+	Ediscard,
+
+	Erasechunk		= 1<<16,	/* blocks per erase command */
+	Erasetimeout		= 60*1000,	/* ms */
+
+	/* EXT_CSD bytes */
+	EXT_CSD_FLUSH_CACHE	= 32,
+	EXT_CSD_CACHE_CTRL	= 33,
+	EXT_CSD_WR_REL_PARAM	= 166,
+	EXT_CSD_REV		= 192,
+	EXT_CSD_REL_WR_SEC_C	= 222,
+	EXT_CSD_SEC_FEATURE	= 231,
+	EXT_CSD_CACHE_SIZE	= 249,
+
+	/* SET_BLOCK_COUNT argument */
+	SBC_RELIABLE		= 1<<31,
+	SBC_FORCED_PRG		= 1<<24,
+
+	Switchtimeout		= 1000,		/* ms */
+	Flushtimeout		= 30*1000,	/* ms */
+	Flushdelay		= 2000,		/* ms of no writes before the cache is flushed */
+	Flushmax		= 5000,		/* ms a write may stay in the cache */
+
+	/* WR_REL_PARAM */
+	EN_REL_WR		= 1<<2,
+};
+
+/*
+ * Read-ahead. Sequential block reads are widened into a
+ * per-controller buffer so the following requests can be
+ * served without going to the card. The window starts at
+ * RAminwin blocks and doubles every time the previous
+ * fill was consumed, up to maxwin.
+ */
+enum {
+	RAbufblk	= 512,	/* buffer size, in 512 byte blocks */
+	RAminwin	= 16,
+	RAdefwin	= 256,
+	RAdirect	= 128,	/* reads this large go straight to the caller */
+
+	/* Ctrlr.xra */
+	Ranone		= 0,
+	Rahit,
+	Rafill,
+};
+
+typedef struct Readahead Readahead;
+struct Readahead {
+	uchar	*buf;
+	uvlong	lba;	/* first block in buf */
+	int	nb;	/* valid blocks in buf */
+	int	used;	/* blocks of buf handed out */
+	int	fill;	/* blocks being read into buf */
+	uvlong	next;	/* block expected if the access is sequential */
+	int	win;	/* current window, 0 if not sequential */
+	int	maxwin;	/* 0 disables read-ahead */
+
+	ulong	hits;
+	ulong	misses;
+	ulong	ahead;	/* blocks read ahead of a request */
+	ulong	wasted;	/* blocks read ahead but never used */
+};
+
+/*
+ * Transfers are serialised by a gate held from iosetup until io,
+ * so that the driver's own commands cannot slip in between. It is
+ * a plain lock: sdmmc holds its card lock across each request and
+ * so never has more than one waiting, leaving nothing to merge or
+ * reorder; the other waiters are the driver's own kprocs, ctl
+ * commands and SDIO.
+ */
+typedef struct Iogate Iogate;
+struct Iogate {
+	QLock;
+	Proc	*owner;
+
+	ulong	nwaits;
+	ulong	maxwait;	/* ms */
+};
+
+/*
+ * I/O statistics. Request latency, from iosetup to the end of io,
+ * is kept in power of two buckets per direction and request size.
+ */
+enum {
+	Sz512	= 0,
+	Sz4k,
+	Sz64k,
+	Szbig,
+	Nsize,
+
+	Latshift	= 5,	/* first bucket is under 32µs */
+	Nlat		= 16,	/* last bucket is 512ms and over */
+};
+
+typedef struct Iostats Iostats;
+struct Iostats {
+	ulong	cmds;
+	ulong	cmderrs;
+	ulong	reads;
+	ulong	writes;
+	uvlong	rbytes;
+	uvlong	wbytes;
+	ulong	dma;
+	ulong	fifo;
+	ulong	dcrc;
+	ulong	rcrc;
+	ulong	rtimeout;
+	ulong	dtimeout;
+	ulong	retries;
+	ulong	xfererrs;	/* failed transfer attempts */
+	ulong	failed;		/* transfers given up on */
+	ulong	clkdowns;
+	ulong	clkups;
+
+	ulong	hist[2][Nsize][Nlat];
+	ulong	maxlat[2][Nsize];	/* µs */
+};
+
+/*
+ * Error recovery. Failed block transfers are retried Nretry times.
+ * Downerrs failures less than Errwindow apart halve the card clock,
+ * up to Maxstep times, it is doubled again after Stablexfers good
+ * transfers once there was no error for Stablems.
+ */
+enum {
+	Nretry		= 4,
+	Downerrs	= 3,
+	Errwindow	= 10*1000,	/* ms */
+	Maxstep		= 3,
+	Stablexfers	= 1000,
+	Stablems	= 60*1000,	/* ms */
+};
+
+/*
+ * Card detect. The detect switch is sampled every Cdpoll, or at
+ * once when the controller sees DAT3 change, and a new state has
+ * to hold for Cdstable samples Cddebounce apart.
+ */
+enum {
+	Cdpoll		= 500,	/* ms */
+	Cddebounce	= 50,	/* ms */
+	Cdstable	= 4,
+};
+
+/*
+ * Delay chain calibration. A sweep reads the same blocks at each
+ * of the Ncal delay settings, the middle of the widest run without
+ * errors is kept for the card clock it was measured at.
+ */
+enum {
+	Ncal		= 64,
+	Ncalset		= 4,	/* settings remembered per controller */
+	Calpasses	= 4,	/* reads per setting */
+	Calline		= 64,	/* longest line of #P/sdhccal */
+};
+
+typedef struct Calpoint Calpoint;
+struct Calpoint {
+	ulong	errors;
+	ulong	kbps;
+};
+
+typedef struct Calset Calset;
+struct Calset {
+	int	hz;
+	int	reg;
+	int	delay;
+};
+
+/*
+ * Benchmark. Every access pattern runs at every size in
+ * benchsizes against a block range. Random offsets come from
+ * a seeded generator so that a run can be repeated. Writes put
+ * back what was read from the same blocks just before, outside
+ * of the measurement.
+ *
+ * At a queue depth over one, that many kprocs each keep an
+ * access waiting at the gate. The controller still runs one
+ * command at a time, so the depth shows in the latencies, which
+ * include the wait for the gate; throughput comes from the
+ * time the transfers themselves took.
+ */
+enum {
+	Nbench		= 32,	/* results kept */
+	Benchops	= 256,
+	Maxbenchops	= 4096,
+	Maxbenchdepth	= 8,
+};
+
+typedef struct Bench Bench;
+struct Bench {
+	char	*name;
+	int	bsize;
+	int	ops;
+	int	depth;
+	int	errors;
+	uvlong	bytes;
+	uvlong	us;	/* sum of the transfer times */
+	ulong	p50;	/* µs */
+	ulong	p90;
+	ulong	p99;
+	ulong	max;
+};
+
+/* the accesses of one run, shared by the kprocs */
+typedef struct Benchq Benchq;
+struct Benchq {
+	Lock;
+	struct Ctrlr	*ctrl;
+	int	ops;
+	int	depth;
+	int	nb;
+	uvlong	*off;
+	uchar	*w;
+	int	next;
+	int	stop;
+	int	running;
+	Rendez	r;
+
+	ulong	*lat;
+	int	n;
+	int	errors;
+	uvlong	us;
+	uvlong	bytes;
+};
+
+static struct {
+	char	*name;
+	int	wpct;	/* percentage of writes */
+	int	rand;
+} benchpat[] = {
+	"seqread",	0,	0,
+	"randread",	0,	1,
+	"seqwrite",	100,	0,
+	"randwrite",	100,	1,
+	"mixed",	30,	1,
+};
+
+static int benchsizes[] = { 512, 4096, 65536, 262144 };
+
+/*
+ * SDIO. SMHC1 is wired to the PinePhone's WiFi module. Function
+ * drivers attach with sdioattach and then use CMD52 and CMD53
+ * through sdiordb, sdiowrb and sdiorw. Card interrupts are passed
+ * to them from the sdioirq kproc.
+ */
+enum {
+	Nsdiofn		= 8,
+	Sdioclk		= 50000000,	/* high speed */
+	Sdioslow	= 25000000,
+	Sdiovolt	= 3<<20,	/* 3.2-3.4V */
+
+	/* CCCR registers */
+	CCCR_IOEN	= 0x02,
+	CCCR_IORDY	= 0x03,
+	CCCR_INTEN	= 0x04,
+	CCCR_INTPEND	= 0x05,
+	CCCR_ABORT	= 0x06,
+	CCCR_BUSIF	= 0x07,
+	CCCR_SPEED	= 0x13,
+	FBR_BLKSIZE	= 0x10,
+
+	/* R5: crc, illegal command, error, function number, out of range */
+	R5_ERRORS	= 0xcb00,
+};
+
+#define Sdioregon	"PL2"	/* WL_REG_ON */
+
+typedef struct Sdiocard Sdiocard;
+struct Sdiocard {
+	QLock;
+	int	ctlrup;	/* SMHC1 powered and reset */
+	int	ready;
+	int	nfn;
+	u32int	rca;
+	int	hz;
+	int	blksize[Nsdiofn];
+	void	(*intr[Nsdiofn])(void*);
+	void	*arg[Nsdiofn];
+
+	Rendez	r;
+	int	pending;
+	int	irqproc;
+	ulong	irqs;
+};
+
+static Sdiocard sdio;
 
 typedef struct Ctrlr Ctrlr;
 static struct Ctrlr {
@@ -202,18 +537,91 @@ static struct Ctrlr {
 	const int mask_data0;
 	const int ntsr;
 	const int maxdma;
+	const char *cdpin;	/* card detect switch, low when a card is in */
+	const int sdio;		/* talks to an SDIO card, not through sdmmc */
 	
 	/* state */
 	int initialize;
+	int intron;
 	int dev;
 	int clk;
 	int datadone;
 	int dma;
 	IdmacChain* dmac;
-	int autocmd;
+	IdmacChain* desc;
 
 	int cmddone;	
 	int cmderr;
+
+	/* card, learned from the initialisation commands */
+	int mmc;
+	int blockaddr;
+	uvlong nblocks;
+	u32int rca;
+	int extcsdrev;
+	int trim;
+	uvlong erased;
+
+	/* eMMC volatile cache */
+	ulong cachesize;	/* KB */
+	int cachewant;
+	int cacheon;
+	int dirty;
+	ulong dirtysince;
+	ulong lastwrite;
+	int flushproc;
+	ulong flushes;
+	int relmax;		/* writes up to this many blocks are reliable */
+	ulong relwrites;
+	int relparam;		/* WR_REL_PARAM */
+	int relsec;		/* REL_WR_SEC_C, legacy reliable write size */
+
+	/* transfer recorded by iosetup, started by cmd */
+	int xwrite;
+	uchar *xbuf;
+	int xbsize;
+	int xbcount;
+	int xcmd;
+	int xra;
+	ulong xoff;
+	SDiocmd *xcmdp;		/* to reissue the command on a retry */
+	u32int xc;
+	u32int xarg;
+	int xrel;
+	int xfail;
+
+	/* clock steps after errors */
+	int busclk;		/* as asked for by sdmmc */
+	int clkstep;
+	int errs;
+	ulong lasterr;
+	ulong okrun;
+
+	Readahead ra;
+	Iogate gate;
+
+	ulong xstart;	/* µs */
+	Iostats stats;
+
+	/* card detect */
+	Rendez cdr;
+	int cdev;
+	int cdstarted;
+	int present;
+	int changed;
+	ulong changes;
+
+	/* delay chains */
+	int clkhz;		/* card clock */
+	u32int xerr;		/* RINTSTS errors seen during the transfer */
+	Calset calset[Ncalset];
+	Calpoint cal[Ncal];	/* last sweep */
+	int calreg;
+	int calhz;
+	int calbest;
+
+	Bench *bench;
+	int nbench;
 };
 
 
@@ -232,19 +640,21 @@ static void debug_idst(Ctrlr *ctrl);
 static void debug_status(Ctrlr *ctrl);
 static void debug_rintsts(Ctrlr *ctrl);
 static void dump_registers(Ctrlr *ctrl, char *header);
+static void xfersetup(Ctrlr *ctrl, int write, void* buf, int bsize, int bcount);
+static void xferdone(Ctrlr *ctrl, int write, uchar* buf, int len);
 
 static int
 datadone(void *a)
 {
 	Ctrlr* ctrl = a;
-	return ctrl->datadone;
+	return ctrl->datadone || ctrl->xerr != 0 || !ctrl->present;
 }
 
 static int
 cmddone(void *a)
 {
 	Ctrlr* ctrl = a;
-	return ctrl->cmddone;
+	return ctrl->cmddone || !ctrl->present;
 }
 
 static int
@@ -304,6 +714,12 @@ cmdwait(Ctrlr *ctrl)
 
 static void sdhcinterrupt(Ureg*, void* a);
 
+static int
+cardpresent(Ctrlr *ctrl)
+{
+	return pioget(ctrl->cdpin) == 0;
+}
+
 static int
 sdhcinit(SDio* s)
 {
@@ -324,11 +740,23 @@ sdhcinit(SDio* s)
 	delay(500);
 
 	ctrl->dmac = 0;
-	ctrl->autocmd = 0;
 	ctrl->dma = 0;
 
-	DBG iprint("%s: Enabling interrupt\n", ctrl->gatename);
-	intrenable(ctrl->irq, sdhcinterrupt, ctrl, BUSUNKNOWN, ctrl->intname);
+	if(!ctrl->intron){
+		DBG iprint("%s: Enabling interrupt\n", ctrl->gatename);
+		intrenable(ctrl->irq, sdhcinterrupt, ctrl, BUSUNKNOWN, ctrl->intname);
+		ctrl->intron = 1;
+	}
+
+	if(ctrl->cdpin != nil){
+		/* cards come and go, see cdproc */
+		ctrl->present = cardpresent(ctrl);
+		return 0;
+	}
+
+	/* soldered down */
+	if(ctrl->sdio)
+		return 0;
 
 	/* XXX: This doesn't seem to be reliable */
 	if (RR(ctrl, STATUS_REG) & STATUS_CARD_PRESENT){
@@ -338,9 +766,46 @@ sdhcinit(SDio* s)
 	return -1;
 }
 
+static Calset*
+calfind(Ctrlr *ctrl, int reg, int hz)
+{
+	Calset *cs;
+
+	for(cs = ctrl->calset; cs < &ctrl->calset[Ncalset]; cs++)
+		if(cs->hz == hz && cs->reg == reg)
+			return cs;
+	return nil;
+}
+
+static void
+calsave(Ctrlr *ctrl, int reg, int hz, int delay)
+{
+	Calset *cs;
+
+	cs = calfind(ctrl, reg, hz);
+	if(cs == nil)
+		cs = calfind(ctrl, 0, 0);
+	if(cs == nil){
+		/* forget the oldest */
+		memmove(&ctrl->calset[0], &ctrl->calset[1], sizeof(Calset)*(Ncalset-1));
+		cs = &ctrl->calset[Ncalset-1];
+	}
+	cs->hz = hz;
+	cs->reg = reg;
+	cs->delay = delay;
+}
+
 static void
 calibratedelay(Ctrlr *ctrl, int reg)
 {
+	Calset *cs;
+
+	/* use what a sweep measured at this clock, see calibrate */
+	cs = calfind(ctrl, reg, ctrl->clkhz);
+	if(cs != nil){
+		WR(ctrl, reg, SAMP_DL_SAMP_DL_SW_EN | cs->delay);
+		return;
+	}
 	WR(ctrl, reg, RR(ctrl, reg) | (1<<7));
 	/* Allegedly calibration causes performance degradation, needs investigation */
 	/*
@@ -367,6 +832,8 @@ setclkspeed(Ctrlr *ctrl, int speed)
 	uint div, ext, hz;
 	u32int buf;
 
+	ctrl->clkhz = speed;
+
 	/* "New timing mode" has an internal divider of 2 */
 	hz = speed*2;
 	div = 1;
@@ -407,9 +874,9 @@ setclkspeed(Ctrlr *ctrl, int speed)
 	WR(ctrl, NTSR_REG, RR(ctrl, NTSR_REG) | NTSR_MODE_SELEC);
 	calibratedelay(ctrl,SAMP_DL_REG);
 	if (ctrl->dev == SMHC2){
-		/* only for HS400 mode?
-		calibratedelay(ctrl,DS_DL_REG);
-		*/
+		/* only for HS400 mode? so only once a sweep has measured it */
+		if(calfind(ctrl, DS_DL_REG, speed) != nil)
+			calibratedelay(ctrl,DS_DL_REG);
 	}
 	buf = RR(ctrl, CLKDIV_REG) | CLKDIV_CCLK_ENB;
 	WR(ctrl, CLKDIV_REG, buf);
@@ -425,6 +892,82 @@ setclkspeed(Ctrlr *ctrl, int speed)
 	DBG iprint("%s: External clock: %uld, internal divider: %ud. Final: %uld\n", ctrl->gatename, getclkrate(ctrl->clk), div, getclkrate(ctrl->clk) / div);
 }
 
+/* change a delay chain with the card clock stopped */
+static void
+setdelay(Ctrlr *ctrl, int reg, u32int val)
+{
+	WR(ctrl, CLKDIV_REG, RR(ctrl, CLKDIV_REG) & ~CLKDIV_CCLK_ENB);
+	WR(ctrl, CMD_REG, CMD_WAIT_PRE_OVER | CMD_PRG_CLK | CMD_CMD_LOAD);
+	clkprogwait(ctrl);
+	WR(ctrl, reg, val);
+	WR(ctrl, CLKDIV_REG, RR(ctrl, CLKDIV_REG) | CLKDIV_CCLK_ENB);
+	WR(ctrl, CMD_REG, CMD_WAIT_PRE_OVER | CMD_PRG_CLK | CMD_CMD_LOAD);
+	clkprogwait(ctrl);
+}
+
+/* forget everything learned about the card */
+static void
+cardforget(Ctrlr *ctrl)
+{
+	ctrl->mmc = 0;
+	ctrl->blockaddr = 0;
+	ctrl->nblocks = 0;
+	ctrl->rca = 0;
+	ctrl->cachesize = 0;
+	ctrl->cacheon = 0;
+	ctrl->dirty = 0;
+	ctrl->clkstep = 0;
+	ctrl->errs = 0;
+	ctrl->ra.nb = 0;
+	ctrl->ra.next = ~0ULL;
+}
+
+static void
+mediachange(Ctrlr *ctrl, int present)
+{
+	ctrl->changes++;
+	ctrl->present = present;
+	cardforget(ctrl);
+	if(present){
+		ctrl->changed = 1;
+		iprint("%s: card inserted\n", ctrl->gatename);
+		return;
+	}
+	iprint("%s: card removed\n", ctrl->gatename);
+
+	/* fail what is waiting for the card */
+	ctrl->cmderr = 1;
+	wakeup(&ctrl->cmdr);
+	wakeup(&ctrl->r);
+}
+
+static int
+cdevent(void *a)
+{
+	return ((Ctrlr*)a)->cdev;
+}
+
+static void
+cdproc(void *a)
+{
+	Ctrlr *ctrl = a;
+	int n;
+
+	n = 0;
+	for(;;){
+		tsleep(&ctrl->cdr, cdevent, ctrl, n > 0 ? Cddebounce : Cdpoll);
+		ctrl->cdev = 0;
+		if(cardpresent(ctrl) == ctrl->present){
+			n = 0;
+			continue;
+		}
+		if(++n < Cdstable)
+			continue;
+		n = 0;
+		mediachange(ctrl, !ctrl->present);
+	}
+}
+
 static void
 sdhcenable(SDio *s)
 {
@@ -438,27 +981,222 @@ sdhcenable(SDio *s)
 
 	WR(ctrl, TMOUT_REG, TMOUT_DTO(0xffffff) | TMOUT_RTO(0xff));
 	WR(ctrl, CTRL_REG, RR(ctrl, CTRL_REG) | CTRL_INT_ENB);
+
+	if(ctrl->cdpin != nil && !ctrl->cdstarted){
+		ctrl->cdstarted = 1;
+		kproc("sdhccd", cdproc, ctrl);
+	}
 }
 
+/* Returns 1 if the gate was taken, 0 if the caller already held it. */
 static int
-sdhccmd(SDio* s, SDiocmd* cmd, u32int arg, u32int *resp)
+gateenter(Ctrlr *ctrl)
+{
+	Iogate *g = &ctrl->gate;
+	ulong t0, w;
+
+	if(g->owner == up)
+		return 0;
+	if(!canqlock(g)){
+		t0 = TK2MS(MACHP(0)->ticks);
+		qlock(g);
+		g->nwaits++;
+		w = TK2MS(MACHP(0)->ticks) - t0;
+		if(w > g->maxwait)
+			g->maxwait = w;
+	}
+	g->owner = up;
+	return 1;
+}
+
+static void
+gateleave(Ctrlr *ctrl)
+{
+	Iogate *g = &ctrl->gate;
+
+	if(g->owner != up)
+		return;
+	g->owner = nil;
+	qunlock(g);
+}
+
+static uint
+rbits(u32int *p, uint start, uint len)
+{
+	uint w, off, v;
+
+	w = start / 32;
+	off = start % 32;
+	v = p[w] >> off;
+	if(off + len > 32)
+		v |= p[w+1] << (32-off);
+	if(len == 32)
+		return v;
+	return v & ((1<<len)-1);
+}
+
+static void
+rainval(Ctrlr *ctrl, uvlong lba, uvlong n)
+{
+	Readahead *ra = &ctrl->ra;
+
+	if(ra->nb == 0)
+		return;
+	if(lba < ra->lba+ra->nb && lba+n > ra->lba){
+		ra->wasted += ra->nb - ra->used;
+		ra->nb = 0;
+	}
+}
+
+/*
+ * Keep track of what sdmmc found out about the card, read-ahead
+ * needs the addressing mode and must not read past the end.
+ */
+static void
+cardsnoop(Ctrlr *ctrl, SDiocmd *cmd, u32int arg, u32int *resp)
+{
+	uint csize, mult, blen;
+
+	if(cmd == &GO_IDLE_STATE){
+		rainval(ctrl, 0, ~0ULL);
+		cardforget(ctrl);
+		return;
+	}
+	if(cmd == &SD_SEND_OP_COND || (cmd->index == 1 && cmd->data == 0)){
+		if(cmd->index == 1)
+			ctrl->mmc = 1;
+		/* CCS for SD, sector access mode for MMC, once powered up */
+		if(resp[0] & (1<<31))
+			ctrl->blockaddr = (resp[0] & (1<<30)) != 0;
+		return;
+	}
+	if(cmd->index == 3 && cmd->data == 0){
+		/* MMC are told their address, SD cards publish it */
+		if(ctrl->mmc)
+			ctrl->rca = arg >> 16;
+		else
+			ctrl->rca = resp[0] >> 16;
+		return;
+	}
+	if(cmd->index == 9 && cmd->resp == 2){
+		/* CSD, bit offsets exclude the crc byte as in sdmmc */
+		if(rbits(resp, 126-8, 2) == 1 && !ctrl->mmc){
+			csize = rbits(resp, 48-8, 22);
+			ctrl->nblocks = (uvlong)(csize+1) << 10;
+		}else{
+			csize = rbits(resp, 62-8, 12);
+			mult = rbits(resp, 47-8, 3);
+			blen = rbits(resp, 80-8, 4);
+			ctrl->nblocks = ((uvlong)(csize+1) << (mult+2+blen)) / 512;
+		}
+		DBG iprint("%s: %llud blocks\n", ctrl->gatename, ctrl->nblocks);
+	}
+}
+
+/* eMMC larger than 2GB only report their size in EXT_CSD */
+static void
+extcsdsnoop(Ctrlr *ctrl, uchar *ext)
+{
+	uvlong n;
+
+	n = ext[212] | ext[213]<<8 | ext[214]<<16 | (u32int)ext[215]<<24;
+	if(n != 0 && ctrl->blockaddr)
+		ctrl->nblocks = n;
+	ctrl->extcsdrev = ext[EXT_CSD_REV];
+	ctrl->trim = (ext[EXT_CSD_SEC_FEATURE] & (1<<4)) != 0;
+	if(ctrl->extcsdrev >= 5)
+		ctrl->cachesize = ext[EXT_CSD_CACHE_SIZE] | ext[EXT_CSD_CACHE_SIZE+1]<<8
+			| ext[EXT_CSD_CACHE_SIZE+2]<<16 | (ulong)ext[EXT_CSD_CACHE_SIZE+3]<<24;
+	ctrl->cacheon = ctrl->cachesize > 0 && (ext[EXT_CSD_CACHE_CTRL] & 1) != 0;
+	ctrl->relparam = ext[EXT_CSD_WR_REL_PARAM];
+	ctrl->relsec = ext[EXT_CSD_REL_WR_SEC_C];
+}
+
+/*
+ * Called with the block address of every block read before
+ * the command is issued. Returns 1 if the request can be served
+ * from the read-ahead buffer. Otherwise ctrl->xra is set to Rafill
+ * when the read should be widened into the buffer.
+ */
+static int
+rastart(Ctrlr *ctrl, u32int arg)
+{
+	Readahead *ra = &ctrl->ra;
+	uvlong lba;
+	int n, fetch;
+
+	if(ra->maxwin <= 0 || ctrl->nblocks == 0 || ctrl->xbsize != 512)
+		return 0;
+
+	n = ctrl->xbcount;
+	lba = ctrl->blockaddr ? arg : arg/512;
+	if(lba != ra->next)
+		ra->win = 0;
+	else if(ra->win == 0)
+		ra->win = RAminwin;
+	ra->next = lba + n;
+
+	if(ra->nb > 0 && lba >= ra->lba && lba+n <= ra->lba+ra->nb){
+		ra->hits++;
+		if(lba+n - ra->lba > ra->used)
+			ra->used = lba+n - ra->lba;
+		ctrl->xoff = (lba - ra->lba)*512;
+		ctrl->xra = Rahit;
+		return 1;
+	}
+	ra->misses++;
+	if(ra->win == 0 || n >= RAdirect)
+		return 0;
+
+	/* grow the window while it pays off, shrink it if it doesn't */
+	if(ra->nb > 0 && ra->used < ra->nb)
+		ra->win = MAX(ra->win/2, RAminwin);
+	else if(ra->nb > 0)
+		ra->win = MIN(ra->win*2, ra->maxwin);
+	if(ra->win > ra->maxwin)
+		ra->win = ra->maxwin;
+
+	fetch = n + ra->win;
+	if(fetch > RAbufblk)
+		fetch = RAbufblk;
+	if(lba + fetch > ctrl->nblocks)
+		fetch = ctrl->nblocks - lba;
+	if(fetch <= n)
+		return 0;
+
+	if(ra->buf == nil && (ra->buf = sdmalloc(RAbufblk*512)) == nil)
+		return 0;
+	rainval(ctrl, 0, ~0ULL);
+	ra->lba = lba;
+	ra->fill = fetch;
+	ra->ahead += fetch - n;
+	ctrl->xra = Rafill;
+	return 0;
+}
+
+static void
+sdhciosetup(SDio* s, int write, void* buf, int bsize, int bcount)
+{
+	Ctrlr *ctrl = s->aux;
+
+	ctrl->xstart = µs();
+	gateenter(ctrl);
+
+	/* the controller is set up by sdhccmd once the block address is known */
+	ctrl->xwrite = write;
+	ctrl->xbuf = buf;
+	ctrl->xbsize = bsize;
+	ctrl->xbcount = bcount;
+}
+
+static u32int
+cmdbits(Ctrlr *ctrl, SDiocmd *cmd)
 {
-	Ctrlr* ctrl = s->aux;
-	DBG iprint("%s: sdhc cmd %s arg: %ux\n", ctrl->gatename, cmd->name, arg);
 	u32int c;
 
 	c = cmd->index & CMD_MASK;
 	if (cmd == &GO_IDLE_STATE)
 		c |= CMD_SEND_INIT_SEQ;
-	else if (cmd == &STOP_TRANSMISSION) {
-		/* autocmd done handles this */
-		return 0;
-	}
-	if(ctrl->dev == SMHC2 && cmd==&SD_SEND_OP_COND){
-		/* SMHC2 is eMMC, not SD. We need to error so that
-                   that sdmmc driver tries mmc.. */
-		error("not sdcard");
-	}
 	c |= CMD_RESP_RCV;
 	switch(cmd->resp){
 	case 0:
@@ -479,51 +1217,798 @@ sdhccmd(SDio* s, SDiocmd* cmd, u32int arg, u32int *resp)
 		break;
 	}
 
-	if(cmd->data){
-		c |= CMD_DATA_TRANS;
-		if(cmd->data & 1){
-			c = c & ~CMD_TRANS_DIR; /* read */
-		}else
-			c |= CMD_TRANS_DIR; /* write */
+	if(cmd->data){
+		c |= CMD_DATA_TRANS;
+		if(cmd->data & 1){
+			c = c & ~CMD_TRANS_DIR; /* read */
+		}else
+			c |= CMD_TRANS_DIR; /* write */
+
+		if (cmd->data > 2)
+			c |= CMD_STOP_CMD_FLAG;
+	}
+	return c;
+}
+
+/* returns 0 if the command failed or timed out */
+static int
+cmdissue(Ctrlr *ctrl, SDiocmd *cmd, u32int c, u32int arg, u32int *resp)
+{
+	int ok;
+
+	if(RR(ctrl, CMD_REG) & CMD_CMD_LOAD){
+		panic("Command already in progress");
+		// return -1;
+	}
+	qlock(ctrl);
+	while(RR(ctrl, STATUS_REG) & (STATUS_CARD_BUSY|STATUS_FSM_BUSY)){
+		delay(10);
+	}
+	/* clear errors */
+	WR(ctrl, RINTSTS_REG, RR(ctrl, RINTSTS_REG));
+	WR(ctrl, CMDARG_REG, arg);
+	WR(ctrl, CMD_REG, c | CMD_CMD_LOAD);
+
+	ctrl->cmddone = 0;
+	ctrl->cmderr = 0;
+	ok = cmdwait(ctrl);
+	ctrl->stats.cmds++;
+	if (!ok){
+		ctrl->stats.cmderrs++;
+		iprint("%s: Command %s (cmd register: %ux) with arg %ux failed\n", ctrl->gatename, cmd->name, c, arg);
+	}
+
+	if(!(c & CMD_RESP_RCV)) {
+		resp[0] = 0;
+	} else if(c & CMD_LONG_RESP) {
+		resp[0] = RR(ctrl, RESP0_REG);
+		resp[1] = RR(ctrl, RESP1_REG);
+		resp[2] = RR(ctrl, RESP2_REG);
+		resp[3] = RR(ctrl, RESP3_REG);
+		DBG iprint("mmc response: 0x%ux 0x%ux 0x%ux 0x%ux\n", resp[0], resp[1], resp[2], resp[3]);
+	} else {
+		resp[0] = RR(ctrl, RESP0_REG);
+		DBG iprint("mmc short response: 0x%ux\n", resp[0]);
+	}
+	qunlock(ctrl);
+	return ok;
+}
+
+static int
+isblkcmd(SDiocmd *cmd)
+{
+	switch(cmd->index){
+	case CMDreadsingle:
+	case CMDreadmulti:
+	case CMDwritesingle:
+	case CMDwritemulti:
+		return 1;
+	}
+	return 0;
+}
+
+static void cachestart(Ctrlr *ctrl);
+static void cachedirty(Ctrlr *ctrl);
+
+/*
+ * A request that took the gate in iosetup failed before or in
+ * io; drop what it set up and release the gate.
+ */
+static void
+ioabort(Ctrlr *ctrl)
+{
+	ctrl->xra = Ranone;
+	ctrl->xbuf = nil;
+	gateleave(ctrl);
+}
+static int relwrite(Ctrlr *ctrl, uvlong lba, int n);
+
+static int
+sdhccmd(SDio* s, SDiocmd* cmd, u32int arg, u32int *resp)
+{
+	Ctrlr* ctrl = s->aux;
+	DBG iprint("%s: sdhc cmd %s arg: %ux\n", ctrl->gatename, cmd->name, arg);
+	u32int c;
+	int held;
+
+	if (cmd == &STOP_TRANSMISSION) {
+		/* autocmd done handles this */
+		return 0;
+	}
+	if(waserror()){
+		/* sdhcio is not coming, let go of the gate from iosetup */
+		ioabort(ctrl);
+		nexterror();
+	}
+	if(!ctrl->present)
+		error("no card");
+	if(ctrl->changed && cmd != &GO_IDLE_STATE){
+		/* make sdmmc start over with the new card */
+		ctrl->changed = 0;
+		error("media changed");
+	}
+	if(cmd == &GO_IDLE_STATE)
+		ctrl->changed = 0;
+	if(ctrl->dev == SMHC2 && cmd==&SD_SEND_OP_COND){
+		/* SMHC2 is eMMC, not SD. We need to error so that
+                   that sdmmc driver tries mmc.. */
+		error("not sdcard");
+	}
+	c = cmdbits(ctrl, cmd);
+
+	if(cmd->data){
+		ctrl->xcmd = cmd->index;
+		ctrl->xra = Ranone;
+		ctrl->xrel = 0;
+		ctrl->xfail = 0;
+		if(ctrl->mmc && ctrl->cachesize > 0 && ctrl->cachewant != ctrl->cacheon && isblkcmd(cmd))
+			cachestart(ctrl);
+		if(cmd->index == CMDreadsingle || cmd->index == CMDreadmulti){
+			if(rastart(ctrl, arg)){
+				resp[0] = R1_TRAN_READY;
+				poperror();
+				return 0;
+			}
+		}else if(cmd->index == CMDwritesingle || cmd->index == CMDwritemulti){
+			rainval(ctrl, ctrl->blockaddr ? arg : arg/512, ctrl->xbcount);
+			if(ctrl->mmc && ctrl->xbcount <= ctrl->relmax
+			&& relwrite(ctrl, ctrl->blockaddr ? arg : arg/512, ctrl->xbcount) == 0){
+				/* the block count is set, no stop command */
+				c = (c & ~(CMD_MASK|CMD_STOP_CMD_FLAG)) | CMDwritemulti;
+				ctrl->xrel = 1;
+			}else
+				cachedirty(ctrl);
+		}
+
+		if(ctrl->xra == Rafill){
+			/* widen the read into the read-ahead buffer */
+			c = (c & ~CMD_MASK) | CMDreadmulti | CMD_STOP_CMD_FLAG;
+			xfersetup(ctrl, 0, ctrl->ra.buf, ctrl->xbsize, ctrl->ra.fill);
+		}else
+			xfersetup(ctrl, ctrl->xwrite, ctrl->xbuf, ctrl->xbsize, ctrl->xbcount);
+	}
+
+	/* data commands hold the gate since iosetup */
+	held = 0;
+	if(!cmd->data)
+		held = gateenter(ctrl);
+	else{
+		ctrl->xcmdp = cmd;
+		ctrl->xc = c;
+		ctrl->xarg = arg;
+	}
+	if(!cmdissue(ctrl, cmd, c, arg, resp) && cmd->data)
+		ctrl->xfail = 1;
+	if(held)
+		gateleave(ctrl);
+	cardsnoop(ctrl, cmd, arg, resp);
+	poperror();
+	return 0;
+}
+
+/*
+ * Commands issued by the driver itself, the caller holds the gate.
+ * Returns -1 if the command failed or the card reported an error.
+ */
+static int
+drvcmd(Ctrlr *ctrl, SDiocmd *cmd, u32int arg, u32int *resp)
+{
+	if(!cmdissue(ctrl, cmd, cmdbits(ctrl, cmd), arg, resp))
+		return -1;
+	if(cmd->resp == 1 && (resp[0] & R1_ERRORS) != 0){
+		iprint("%s: %s: card status %ux\n", ctrl->gatename, cmd->name, resp[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+cardidle(void *a)
+{
+	Ctrlr *ctrl = a;
+
+	return (RR(ctrl, STATUS_REG) & STATUS_CARD_BUSY) == 0;
+}
+
+static void
+waitidle(Ctrlr *ctrl, int ms)
+{
+	int t;
+
+	/* t in µs, most busy periods are much shorter than a tick */
+	for(t = 0; !cardidle(ctrl); t += 250){
+		if(t >= ms*1000)
+			error("card busy timeout");
+		utsleep(&up->sleep, cardidle, ctrl, 250);
+	}
+}
+
+/* write an EXT_CSD byte, the caller holds the gate */
+static void
+mmcswitch(Ctrlr *ctrl, int index, int value, int ms)
+{
+	u32int resp[4];
+
+	if(drvcmd(ctrl, &MMC_SWITCH, 3<<24 | index<<16 | value<<8, resp) < 0)
+		error("switch failed");
+	waitidle(ctrl, ms);
+	if(drvcmd(ctrl, &CARD_STATUS, ctrl->rca<<16, resp) < 0 || (resp[0] & R1_SWITCH_ERROR) != 0)
+		error("switch failed");
+}
+
+/* the caller holds the gate */
+static void
+cacheflush(Ctrlr *ctrl)
+{
+	if(!ctrl->cacheon || !ctrl->dirty)
+		return;
+	mmcswitch(ctrl, EXT_CSD_FLUSH_CACHE, 1, Flushtimeout);
+	ctrl->dirty = 0;
+	ctrl->flushes++;
+}
+
+/*
+ * Bring the card's cache in line with cachewant, the caller holds
+ * the gate. Turning the cache off makes the card flush it.
+ */
+static void
+cacheset(Ctrlr *ctrl)
+{
+	if(ctrl->cachewant == ctrl->cacheon || ctrl->cachesize == 0)
+		return;
+	mmcswitch(ctrl, EXT_CSD_CACHE_CTRL, ctrl->cachewant, Flushtimeout);
+	ctrl->cacheon = ctrl->cachewant;
+	ctrl->dirty = 0;
+}
+
+/* a write went to the card's cache */
+static void
+cachedirty(Ctrlr *ctrl)
+{
+	ulong now;
+
+	if(!ctrl->cacheon)
+		return;
+	now = TK2MS(MACHP(0)->ticks);
+	if(!ctrl->dirty)
+		ctrl->dirtysince = now;
+	ctrl->dirty = 1;
+	ctrl->lastwrite = now;
+}
+
+/*
+ * Writes go to the card's cache, flush it once the writes
+ * have stopped for Flushdelay, and under steady writes at
+ * least every Flushmax.
+ */
+static void
+flushproc(void *a)
+{
+	Ctrlr *ctrl = a;
+	ulong now;
+
+	for(;;){
+		tsleep(&up->sleep, return0, nil, Flushdelay/2);
+		if(!ctrl->dirty)
+			continue;
+		now = TK2MS(MACHP(0)->ticks);
+		if(now - ctrl->lastwrite < Flushdelay && now - ctrl->dirtysince < Flushmax)
+			continue;
+		gateenter(ctrl);
+		if(!waserror()){
+			cacheflush(ctrl);
+			poperror();
+		}
+		gateleave(ctrl);
+	}
+}
+
+static void
+flushstart(Ctrlr *ctrl)
+{
+	if(ctrl->cacheon && !ctrl->flushproc){
+		ctrl->flushproc = 1;
+		kproc("sdhcflush", flushproc, ctrl);
+	}
+}
+
+/*
+ * From exit and reboot: flush the caches, if this is a process
+ * that can wait for it rather than a panic.
+ */
+static void
+sdhcshutdown(void)
+{
+	Ctrlr *ctrl;
+	int i;
+
+	if(up == nil || !islo())
+		return;
+	for(i = 0; i < nelem(ctrls); i++){
+		ctrl = &ctrls[i];
+		if(!ctrl->cacheon || !ctrl->dirty)
+			continue;
+		gateenter(ctrl);
+		if(!waserror()){
+			cacheflush(ctrl);
+			poperror();
+		}
+		gateleave(ctrl);
+	}
+}
+
+/* called from sdhccmd before the first block transfer after initialisation */
+static void
+cachestart(Ctrlr *ctrl)
+{
+	if(waserror()){
+		iprint("%s: cache: %s\n", ctrl->gatename, up->errstr);
+		ctrl->cachewant = ctrl->cacheon;
+		return;
+	}
+	cacheset(ctrl);
+	poperror();
+	flushstart(ctrl);
+}
+
+/*
+ * Make the next write of n blocks at lba a reliable write. The
+ * card then guarantees the old or the new data survives a power
+ * loss, and the data bypasses the cache on 4.5 and later. Without
+ * EN_REL_WR the card only does it for one block, or REL_WR_SEC_C
+ * blocks aligned to that; other writes are left as they are.
+ */
+static int
+relwrite(Ctrlr *ctrl, uvlong lba, int n)
+{
+	u32int resp[4], arg;
+
+	if(n <= 0 || n > 0xFFFF)
+		return -1;
+	if((ctrl->relparam & EN_REL_WR) == 0 && n != 1
+	&& (ctrl->relsec == 0 || n != ctrl->relsec || lba % ctrl->relsec != 0))
+		return -1;
+
+	arg = SBC_RELIABLE | n & 0xFFFF;
+	if(ctrl->extcsdrev >= 6)
+		arg |= SBC_FORCED_PRG;
+	if(drvcmd(ctrl, &SET_BLOCK_COUNT, arg, resp) < 0)
+		return -1;
+	ctrl->relwrites++;
+	return 0;
+}
+
+/*
+ * Discard blocks lba to lba+nb-1. eMMC are sent TRIM, or DISCARD
+ * if asked for and the card is recent enough; SD cards get ERASE,
+ * which has the same effect on their mapping.
+ */
+static void
+discard(Ctrlr *ctrl, uvlong lba, uvlong nb, int how)
+{
+	SDiocmd *start, *end;
+	u32int resp[4], arg;
+	uvlong n;
+	int shift;
+
+	if(ctrl->nblocks == 0 || ctrl->rca == 0)
+		error("card not initialised");
+	if(nb == 0 || lba >= ctrl->nblocks || nb > ctrl->nblocks - lba)
+		error("range beyond end of card");
+	if(ctrl->mmc){
+		start = &MMC_ERASE_START;
+		end = &MMC_ERASE_END;
+		if(how == Ediscard && ctrl->extcsdrev >= 6)
+			arg = ERASE_ARG_DISCARD;
+		else if(ctrl->trim)
+			arg = ERASE_ARG_TRIM;
+		else
+			error("card does not support trim");
+	}else{
+		start = &SD_ERASE_START;
+		end = &SD_ERASE_END;
+		arg = 0;
+	}
+	shift = ctrl->blockaddr ? 0 : 9;
+
+	while(nb > 0){
+		n = MIN(nb, Erasechunk);
+		gateenter(ctrl);
+		if(waserror()){
+			gateleave(ctrl);
+			nexterror();
+		}
+		rainval(ctrl, lba, n);
+		if(drvcmd(ctrl, start, lba<<shift, resp) < 0
+		|| drvcmd(ctrl, end, (lba+n-1)<<shift, resp) < 0
+		|| drvcmd(ctrl, &ERASE_BLOCKS, arg, resp) < 0)
+			error("erase failed");
+		waitidle(ctrl, Erasetimeout);
+		if(drvcmd(ctrl, &CARD_STATUS, ctrl->rca<<16, resp) < 0)
+			error("erase failed");
+		ctrl->erased += n;
+		poperror();
+		gateleave(ctrl);
+		lba += n;
+		nb -= n;
+	}
+}
+
+static void
+dmacfree(Ctrlr *ctrl)
+{
+	if(ctrl->dmac != ctrl->desc)
+		sdfree(ctrl->dmac);
+	ctrl->dmac = nil;
+}
+
+/*
+ * Get the controller and the card back to a known state
+ * after a failed transfer, the caller holds the gate.
+ */
+static void
+recover(Ctrlr *ctrl)
+{
+	u32int resp[4];
+	int timeout;
+
+	WR(ctrl, DMAC_REG, DMAC_IDMAC_RST);
+	WR(ctrl, CTRL_REG, RR(ctrl, CTRL_REG) | CTRL_DMA_RST | CTRL_FIFO_RST);
+	timeout = 1000;
+	while(timeout-- && (RR(ctrl, CTRL_REG) & (CTRL_DMA_RST|CTRL_FIFO_RST)))
+		;
+	if(ctrl->dmac != nil)
+		dmacfree(ctrl);
+	WR(ctrl, IDST_REG, RR(ctrl, IDST_REG));
+	WR(ctrl, RINTSTS_REG, RR(ctrl, RINTSTS_REG));
+
+	/* the card may still be in a data state, fails harmlessly if not */
+	if(ctrl->rca != 0)
+		drvcmd(ctrl, &STOP_BLOCKS, 0, resp);
+	ctrl->xerr = 0;
+}
+
+/*
+ * Block transfer issued by the driver itself, the caller holds
+ * the gate. Returns -1 if the command failed or the controller
+ * flagged an error during the transfer.
+ */
+static int
+drvio(Ctrlr *ctrl, int write, uchar *buf, uvlong lba, int nb)
+{
+	u32int resp[4];
+
+	if(write){
+		rainval(ctrl, lba, nb);
+		cachedirty(ctrl);
+	}
+	xfersetup(ctrl, write, buf, 512, nb);
+	if(drvcmd(ctrl, write ? &WRITE_BLOCKS : &READ_BLOCKS, ctrl->blockaddr ? lba : lba*512, resp) < 0){
+		recover(ctrl);
+		return -1;
+	}
+	xferdone(ctrl, write, buf, nb*512);
+	if(ctrl->xerr != 0 || !ctrl->datadone){
+		recover(ctrl);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sweep the delay chain reg at the current card clock, reading
+ * nb blocks from lba Calpasses times per setting. The result of
+ * every setting is kept in ctrl->cal for sdhccal.
+ */
+static void
+calibrate(Ctrlr *ctrl, int reg, uvlong lba, int nb)
+{
+	Calpoint *cp;
+	uchar *buf;
+	u32int orig;
+	ulong t;
+	int d, i, run, bestrun, best;
+
+	if(ctrl->nblocks == 0 || ctrl->rca == 0)
+		error("card not initialised");
+	if(reg == DS_DL_REG && ctrl->dev != SMHC2)
+		error("no data strobe delay on this controller");
+	if(nb <= 0 || nb > RAbufblk || lba >= ctrl->nblocks || nb > ctrl->nblocks - lba)
+		error("range beyond end of card");
+	buf = sdmalloc(nb*512);
+	if(buf == nil)
+		error(Enomem);
+	gateenter(ctrl);
+	orig = RR(ctrl, reg);
+	if(waserror()){
+		setdelay(ctrl, reg, orig);
+		gateleave(ctrl);
+		sdfree(buf);
+		nexterror();
+	}
+	ctrl->calreg = reg;
+	ctrl->calhz = ctrl->clkhz;
+	ctrl->calbest = -1;
+	for(d = 0; d < Ncal; d++){
+		setdelay(ctrl, reg, SAMP_DL_SAMP_DL_SW_EN | d);
+		cp = &ctrl->cal[d];
+		cp->errors = 0;
+		t = µs();
+		for(i = 0; i < Calpasses; i++)
+			if(drvio(ctrl, 0, buf, lba, nb) < 0)
+				cp->errors++;
+		t = µs() - t;
+		cp->kbps = t > 0 ? (uvlong)Calpasses*nb*512*1000 / ((uvlong)t*1024) : 0;
+		if(!ctrl->present)
+			error("no card");
+	}
+
+	/* the middle of the widest run of settings without errors */
+	best = -1;
+	run = bestrun = 0;
+	for(d = 0; d < Ncal; d++){
+		if(ctrl->cal[d].errors != 0){
+			run = 0;
+			continue;
+		}
+		if(++run > bestrun){
+			bestrun = run;
+			best = d - run/2;
+		}
+	}
+	if(best < 0)
+		error("no setting without errors");
+	setdelay(ctrl, reg, SAMP_DL_SAMP_DL_SW_EN | best);
+	calsave(ctrl, reg, ctrl->clkhz, best);
+	ctrl->calbest = best;
+	poperror();
+	gateleave(ctrl);
+	sdfree(buf);
+}
+
+static ulong
+benchrand(ulong *s)
+{
+	ulong x;
+
+	x = *s;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*s = x;
+	return x;
+}
+
+static void
+sortlat(ulong *a, int n)
+{
+	int g, i, j;
+	ulong t;
+
+	for(g = n/2; g > 0; g /= 2)
+		for(i = g; i < n; i++)
+			for(j = i-g; j >= 0 && a[j] > a[j+g]; j -= g){
+				t = a[j];
+				a[j] = a[j+g];
+				a[j+g] = t;
+			}
+}
+
+/* benchmark time, from the high speed timer if there is one */
+static ulong
+benchus(void)
+{
+	if(hstmrfreq() == 0)
+		return µs();
+	return hstmrns(hstmrticks())/1000;
+}
+
+/*
+ * one benchmark access, a write is preceded by a read of the same
+ * blocks. lat is from asking for the gate to the end of the timed
+ * transfer, less the read; svc the timed transfer alone.
+ */
+static int
+benchop(Ctrlr *ctrl, int write, uchar *buf, uvlong lba, int nb, ulong *lat, ulong *svc)
+{
+	ulong t0, t;
+	int r;
+
+	*lat = *svc = 0;
+	t0 = benchus();
+	gateenter(ctrl);
+	t = benchus();
+	*lat = t - t0;
+	if(write && drvio(ctrl, 0, buf, lba, nb) < 0)
+		r = -1;
+	else{
+		t = benchus();
+		r = drvio(ctrl, write, buf, lba, nb);
+		*svc = benchus() - t;
+		*lat += *svc;
+	}
+	gateleave(ctrl);
+	return r;
+}
+
+/* run the queued accesses until there are none left */
+static void
+benchwork(Benchq *q, uchar *buf)
+{
+	Ctrlr *ctrl = q->ctrl;
+	ulong lat, svc;
+	int i, r;
+
+	for(;;){
+		lock(q);
+		i = q->next++;
+		unlock(q);
+		if(i >= q->ops || q->stop || !ctrl->present)
+			break;
+		r = benchop(ctrl, q->w[i], buf, q->off[i], q->nb, &lat, &svc);
+		lock(q);
+		if(r < 0)
+			q->errors++;
+		else{
+			q->lat[q->n++] = lat;
+			q->us += svc;
+			q->bytes += q->nb*512;
+		}
+		unlock(q);
+	}
+}
+
+static void
+benchproc(void *a)
+{
+	Benchq *q = a;
+	uchar *buf;
+
+	buf = sdmalloc(q->nb*512);
+	if(buf != nil){
+		if(!waserror()){
+			benchwork(q, buf);
+			poperror();
+		}
+		sdfree(buf);
+	}
+	/* wakeup under the lock, benchqueue frees q once it has it */
+	lock(q);
+	q->running--;
+	wakeup(&q->r);
+	unlock(q);
+	pexit("", 1);
+}
+
+static int
+benchidle(void *a)
+{
+	return ((Benchq*)a)->running == 0;
+}
+
+/* depth kprocs keep that many accesses waiting at the gate */
+static void
+benchqueue(Benchq *q)
+{
+	int i;
+
+	q->running = q->depth;
+	for(i = 0; i < q->depth; i++)
+		kproc("sdhcbench", benchproc, q);
+	/* the kprocs use q, wait for them whatever happens */
+	while(waserror())
+		q->stop = 1;
+	sleep(&q->r, benchidle, q);
+	poperror();
+	lock(q);
+	unlock(q);
+	if(q->stop)
+		error(Eintr);
+}
 
-		if (cmd->data > 2){
-			ctrl->autocmd = 1;
-			c |= CMD_STOP_CMD_FLAG;
-		}
-	}
+static void
+benchrun(Ctrlr *ctrl, Benchq *q, int pat, int bsize, uvlong lba, uvlong count, ulong seed, uchar *buf)
+{
+	Bench *b;
+	uvlong slots;
+	int i, nb, n;
 
-	if(RR(ctrl, CMD_REG) & CMD_CMD_LOAD){
-		panic("Command already in progress");
-		// return -1;
-	}
-	qlock(ctrl);
-	while(RR(ctrl, STATUS_REG) & (STATUS_CARD_BUSY|STATUS_FSM_BUSY)){
-		delay(10);
+	nb = bsize/512;
+	slots = count/nb;
+	if(slots == 0 || ctrl->nbench >= Nbench)
+		return;
+	b = &ctrl->bench[ctrl->nbench++];
+	memset(b, 0, sizeof *b);
+	b->name = benchpat[pat].name;
+	b->bsize = bsize;
+	b->ops = q->ops;
+	b->depth = q->depth;
+
+	/* the same accesses whatever the depth */
+	for(i = 0; i < q->ops; i++){
+		if(benchpat[pat].rand)
+			q->off[i] = lba + benchrand(&seed) % slots * nb;
+		else
+			q->off[i] = lba + i % slots * nb;
+		q->w[i] = benchpat[pat].wpct > 0 && benchrand(&seed) % 100 < benchpat[pat].wpct;
 	}
-	/* clear errors */
-	WR(ctrl, RINTSTS_REG, RR(ctrl, RINTSTS_REG));
-	WR(ctrl, CMDARG_REG, arg);
-	WR(ctrl, CMD_REG, c | CMD_CMD_LOAD);
-
-	ctrl->cmddone = 0;
-	ctrl->cmderr = 0;
-	if (!cmdwait(ctrl))
-		iprint("%s: Command %s (cmd register: %ux) with arg %ux failed\n", ctrl->gatename, cmd->name, c, arg);
+	q->nb = nb;
+	q->next = q->n = q->errors = 0;
+	q->us = q->bytes = 0;
+	if(q->depth == 1)
+		benchwork(q, buf);
+	else
+		benchqueue(q);
+	if(!ctrl->present)
+		error("no card");
+	b->errors = q->errors;
+	b->bytes = q->bytes;
+	b->us = q->us;
+	n = q->n;
+	if(n == 0)
+		return;
+	sortlat(q->lat, n);
+	b->p50 = q->lat[n*50/100];
+	b->p90 = q->lat[n*90/100];
+	b->p99 = q->lat[n*99/100];
+	b->max = q->lat[n-1];
+}
 
-	if(!(c & CMD_RESP_RCV)) {
-		resp[0] = 0;
-	} else if(c & CMD_LONG_RESP) {
-		resp[0] = RR(ctrl, RESP0_REG);
-		resp[1] = RR(ctrl, RESP1_REG);
-		resp[2] = RR(ctrl, RESP2_REG);
-		resp[3] = RR(ctrl, RESP3_REG);
-		DBG iprint("mmc response: 0x%ux 0x%ux 0x%ux 0x%ux\n", resp[0], resp[1], resp[2], resp[3]);
-	} else {
-		resp[0] = RR(ctrl, RESP0_REG);
-		DBG iprint("mmc short response: 0x%ux\n", resp[0]);
+/*
+ * Run the benchmark on blocks lba to lba+count-1, ops accesses
+ * per pattern and size, depth of them outstanding at a time.
+ * The write patterns only run if asked for.
+ */
+static void
+bench(Ctrlr *ctrl, uvlong lba, uvlong count, int ops, ulong seed, int write, int depth)
+{
+	uchar *buf;
+	Benchq *q;
+	int p, i;
+
+	if(ctrl->nblocks == 0 || ctrl->rca == 0)
+		error("card not initialised");
+	if(count == 0 || lba >= ctrl->nblocks || count > ctrl->nblocks - lba)
+		error("range beyond end of card");
+	if(ops <= 0 || ops > Maxbenchops)
+		error("bad number of operations");
+	if(depth <= 0 || depth > Maxbenchdepth)
+		error("bad queue depth");
+	if(seed == 0)
+		seed = 1;
+	if(ctrl->bench == nil)
+		ctrl->bench = smalloc(sizeof(Bench)*Nbench);
+	buf = sdmalloc(benchsizes[nelem(benchsizes)-1]);
+	if(buf == nil)
+		error(Enomem);
+	q = smalloc(sizeof(Benchq));
+	q->ctrl = ctrl;
+	q->ops = ops;
+	q->depth = depth;
+	q->off = smalloc(sizeof(uvlong)*ops);
+	q->w = smalloc(ops);
+	q->lat = smalloc(sizeof(ulong)*ops);
+	if(waserror()){
+		sdfree(buf);
+		free(q->off);
+		free(q->w);
+		free(q->lat);
+		free(q);
+		nexterror();
 	}
-	qunlock(ctrl);
-	return 0;
+	ctrl->nbench = 0;
+	for(p = 0; p < nelem(benchpat); p++){
+		if(benchpat[p].wpct > 0 && !write)
+			continue;
+		for(i = 0; i < nelem(benchsizes); i++)
+			benchrun(ctrl, q, p, benchsizes[i], lba, count, seed, buf);
+	}
+	poperror();
+	sdfree(buf);
+	free(q->off);
+	free(q->w);
+	free(q->lat);
+	free(q);
 }
 
 static void
@@ -544,23 +2029,25 @@ fiforeset(Ctrlr *ctrl)
 }
 
 static void
-sdhciosetup(SDio* s, int write, void* buf, int bsize, int bcount)
+xfersetup(Ctrlr *ctrl, int write, void* buf, int bsize, int bcount)
 {
-	Ctrlr *ctrl = s->aux;
 	int timeout;
 	int len = bsize*bcount;
 	int ndesc, lenrem, i;
 	IdmacChain *curdesc;
-	DBG iprint("%s: sdhciosetup. %s %d*%d=%d\n", ctrl->gatename, write ? "write" : "read", bsize, bcount, len);
+	DBG iprint("%s: xfersetup. %s %d*%d=%d\n", ctrl->gatename, write ? "write" : "read", bsize, bcount, len);
+
+	ctrl->xerr = 0;
 
 	WR(ctrl, DMAC_REG, RR(ctrl, DMAC_REG) & ~DMAC_IDMAC_ENB);
 	WR(ctrl, BLKSIZ_REG, BLKSIZ_BLK_SZ(bsize));
 	WR(ctrl, BYTCNT_REG, (u32int )len);
 
-	/* arbitrary cutoff for dma */
-	if (len < 512) {
+	/* arbitrary cutoff for dma, the engine needs word aligned buffers and lengths */
+	if (len < 512 || ((uintptr)buf & 3) != 0 || (len & 3) != 0) {
 		/* Transfer via FIFO register */
 		ctrl->dma = 0;
+		ctrl->stats.fifo++;
 		WR(ctrl, CTRL_REG, (RR(ctrl, CTRL_REG) & ~(CTRL_DMA_ENB)) | CTRL_FIFO_AC_MOD);
 		fiforeset(ctrl);
 
@@ -573,12 +2060,18 @@ sdhciosetup(SDio* s, int write, void* buf, int bsize, int bcount)
 	} else {
 		/* Transfer via DMA */
 		ctrl->dma = 1;
+		ctrl->stats.dma++;
 		ndesc = len / ctrl->maxdma;
 		if (len % ctrl->maxdma != 0){
 			ndesc++;
 		}
 
-		ctrl->dmac = sdmalloc(sizeof(IdmacChain)*(ndesc));
+		if(ctrl->desc == nil)
+			ctrl->desc = sdmalloc(sizeof(IdmacChain)*Ndesc);
+		if(ndesc <= Ndesc && ctrl->desc != nil)
+			ctrl->dmac = ctrl->desc;
+		else
+			ctrl->dmac = sdmalloc(sizeof(IdmacChain)*(ndesc));
 		DBG iprint("%s: Initiating DMA xfer\n", ctrl->gatename);
 		ctrl->datadone = 0;
 		lenrem = len;
@@ -639,11 +2132,14 @@ sdhciosetup(SDio* s, int write, void* buf, int bsize, int bcount)
 		WR(ctrl, DMAC_REG, DMAC_FIX_BUST_CTRL | DMAC_IDMAC_ENB);
 		WR(ctrl, DLBA_REG, PADDR(ctrl->dmac));
 		WR(ctrl, FIFOTH_REG, 8 | (7<<16) | (2<<28));
+
+		/*
+		 * The only pass for a write. A read drops the lines here,
+		 * so none can be evicted over the incoming data, and again
+		 * in xferdone.
+		 */
+		dmaflush(write, buf, len);
 	}
-	if (write)
-		cachedwbse(buf, len);
-	else
-		cachedwbinvse(buf, len);
 }
 
 static void
@@ -653,6 +2149,7 @@ sdhcinterrupt(Ureg*, void* a)
 	// DBG iprint("sdhcinterrupt\n");
 	u32int reg = RR(ctrl, RINTSTS_REG);
 	WR(ctrl, RINTSTS_REG, reg);
+	ctrl->xerr |= reg & INT_XFER_ERRORS;
 
 	if(reg & INT_RE){
 		ctrl->cmderr = 1;
@@ -668,6 +2165,7 @@ sdhcinterrupt(Ureg*, void* a)
 		wakeup(&ctrl->cmdr);
 	}
 	if (reg & INT_RTO_BACK){
+		ctrl->stats.rtimeout++;
 		iprint("%s: response timeout\n", ctrl->gatename);
 	}
 
@@ -690,13 +2188,20 @@ sdhcinterrupt(Ureg*, void* a)
 
 	}
 
+	if (reg & (INT_CARD_REMOVAL|INT_CARD_INSERT)){
+		DBG iprint("%s: Card %s\n", ctrl->gatename, (reg & INT_CARD_INSERT) ? "insert" : "removal");
+		ctrl->cdev = 1;
+		wakeup(&ctrl->cdr);
+	}
+
+	if ((reg & INT_SDIOI_INT) && ctrl->sdio){
+		/* level triggered, masked until sdioproc has run the handlers */
+		WR(ctrl, INTMASK_REG, RR(ctrl, INTMASK_REG) & ~INT_SDIOI_INT);
+		sdio.pending = 1;
+		wakeup(&sdio.r);
+	}
+
 	/* Unhandled interrupts, just print them if they happen */
-	if (reg & INT_CARD_REMOVAL)
-		iprint("%s: Card removal\n", ctrl->gatename);
-	if (reg & INT_CARD_INSERT)
-		iprint("%s: Card insert\n", ctrl->gatename);
-	if (reg & INT_SDIOI_INT)
-		DBG iprint("%s: SDIO interrupt\n", ctrl->gatename);
 	if (reg & INT_DEE)
 		iprint("%s: Data end-bit error\n", ctrl->gatename);
 	if (reg & INT_DSE_BC)
@@ -707,14 +2212,19 @@ sdhcinterrupt(Ureg*, void* a)
 		iprint("%s: FIFO underrun /overflow\n", ctrl->gatename);
 	if (reg & INT_DSTO_VSD)
 		iprint("%s: Data starvation timeout / v1.8 switch done\n", ctrl->gatename);
-	if (reg & INT_DTO_BDS)
+	if (reg & INT_DTO_BDS){
+		ctrl->stats.dtimeout++;
 		iprint("%s: data timeout / boot data startout\n", ctrl->gatename);
+	}
 	if (reg & INT_DCE){
+		ctrl->stats.dcrc++;
 		iprint("%s: data crc error\n", ctrl->gatename);
 		// panic("CRC error");
 	}
-	if (reg & INT_RCE)
+	if (reg & INT_RCE){
+		ctrl->stats.rcrc++;
 		iprint("%s: response crc error\n", ctrl->gatename);
+	}
 }
 
 static int
@@ -725,51 +2235,224 @@ sdhcinquiry(SDio *, char* inquiry, int inqlen)
 	);
 }
 
+static void
+account(Ctrlr *ctrl, int write, int len)
+{
+	Iostats *st = &ctrl->stats;
+	ulong lat;
+	int sz, b;
+
+	if(write){
+		st->writes++;
+		st->wbytes += len;
+	}else{
+		st->reads++;
+		st->rbytes += len;
+	}
+	if(len <= 512)
+		sz = Sz512;
+	else if(len <= 4096)
+		sz = Sz4k;
+	else if(len <= 65536)
+		sz = Sz64k;
+	else
+		sz = Szbig;
+	lat = µs() - ctrl->xstart;
+	for(b = 0; b < Nlat-1 && lat >= 1UL<<(b+Latshift); b++)
+		;
+	st->hist[write != 0][sz][b]++;
+	if(lat > st->maxlat[write != 0][sz])
+		st->maxlat[write != 0][sz] = lat;
+}
+
+static int
+xferok(Ctrlr *ctrl)
+{
+	return ctrl->xerr == 0 && (ctrl->datadone || !ctrl->dma) && ctrl->present;
+}
+
+/* count a failed attempt, too many of them slow the clock down */
+static void
+xfererror(Ctrlr *ctrl)
+{
+	ulong now;
+
+	now = TK2MS(MACHP(0)->ticks);
+	ctrl->stats.xfererrs++;
+	ctrl->okrun = 0;
+	if(now - ctrl->lasterr > Errwindow)
+		ctrl->errs = 0;
+	ctrl->lasterr = now;
+	if(++ctrl->errs < Downerrs || ctrl->clkstep >= Maxstep || ctrl->busclk == 0)
+		return;
+	ctrl->errs = 0;
+	ctrl->clkstep++;
+	ctrl->stats.clkdowns++;
+	iprint("%s: transfer errors, clock down to %dHz\n", ctrl->gatename, ctrl->busclk >> ctrl->clkstep);
+	setclkspeed(ctrl, ctrl->busclk >> ctrl->clkstep);
+}
+
+/* count a good transfer, step the clock back up once stable */
+static void
+xfergood(Ctrlr *ctrl)
+{
+	if(ctrl->clkstep == 0)
+		return;
+	if(++ctrl->okrun < Stablexfers || TK2MS(MACHP(0)->ticks) - ctrl->lasterr < Stablems)
+		return;
+	ctrl->okrun = 0;
+	ctrl->clkstep--;
+	ctrl->stats.clkups++;
+	iprint("%s: clock back up to %dHz\n", ctrl->gatename, ctrl->busclk >> ctrl->clkstep);
+	setclkspeed(ctrl, ctrl->busclk >> ctrl->clkstep);
+}
+
+/*
+ * Finish the transfer started by sdhccmd. Failed block transfers
+ * are reissued from the command on, returns 0 if they kept failing.
+ */
+static int
+xfer(Ctrlr *ctrl, int write, uchar *buf, int len)
+{
+	u32int resp[4];
+	int i;
+
+	if(!ctrl->xfail){
+		xferdone(ctrl, write, buf, len);
+		if(xferok(ctrl)){
+			xfergood(ctrl);
+			return 1;
+		}
+	}
+	for(i = 0; i < Nretry && ctrl->present && isblkcmd(ctrl->xcmdp); i++){
+		recover(ctrl);
+		xfererror(ctrl);
+		ctrl->stats.retries++;
+		if(ctrl->xrel && relwrite(ctrl, ctrl->blockaddr ? ctrl->xarg : ctrl->xarg/512, len/ctrl->xbsize) < 0)
+			continue;
+		xfersetup(ctrl, write, buf, ctrl->xbsize, len/ctrl->xbsize);
+		if(!cmdissue(ctrl, ctrl->xcmdp, ctrl->xc, ctrl->xarg, resp))
+			continue;
+		xferdone(ctrl, write, buf, len);
+		if(xferok(ctrl)){
+			xfergood(ctrl);
+			return 1;
+		}
+	}
+	recover(ctrl);
+	xfererror(ctrl);
+	ctrl->stats.failed++;
+	iprint("%s: %s %s of %d bytes failed\n", ctrl->gatename, ctrl->xcmdp->name,
+		write ? "write" : "read", len);
+	return 0;
+}
+
 static void
 sdhcio(SDio* s, int write, uchar* buf, int len)
 {
 	Ctrlr *ctrl = s->aux;
-	int i;
-	u32int *wbuf; // buf in words
-	DBG iprint("%s: sdhcio %s to %p sz %d\n", ctrl->gatename, write ? "write" : "read", buf, len);
-	if(ctrl->autocmd)
-		tsleep(&ctrl->r, datadone, ctrl, 3000);
+	Readahead *ra = &ctrl->ra;
+	int ok;
+
+	if(waserror()){
+		ioabort(ctrl);
+		nexterror();
+	}
+	ok = 1;
+	switch(ctrl->xra){
+	case Rahit:
+		memmove(buf, ra->buf + ctrl->xoff, len);
+		break;
+	case Rafill:
+		ok = xfer(ctrl, 0, ra->buf, ra->fill*512);
+		if(ok){
+			ra->nb = ra->fill;
+			ra->used = len/512;
+		}
+		memmove(buf, ra->buf, len);
+		break;
+	default:
+		ok = xfer(ctrl, write, buf, len);
+		if(ok && !write && ctrl->xcmd == 8)
+			extcsdsnoop(ctrl, buf);
+	}
+	poperror();
+	ctrl->xra = Ranone;
+	ctrl->xbuf = nil;
+	account(ctrl, write, len);
+	gateleave(ctrl);
+	if(!ctrl->present)
+		error("no card");
+	if(!ok && isblkcmd(ctrl->xcmdp))
+		error(Eio);
+}
+
+/* wait for room or data in the fifo, gives up once the transfer failed */
+static int
+fifowait(Ctrlr *ctrl, u32int bit)
+{
+	while(RR(ctrl, STATUS_REG) & bit){
+		if(ctrl->xerr != 0 || !ctrl->present)
+			return -1;
+		delay(5);
+	}
+	return 0;
+}
+
+static void
+xferdone(Ctrlr *ctrl, int write, uchar* buf, int len)
+{
+	int i, n, aligned;
+	u32int w;
+	DBG iprint("%s: xferdone %s to %p sz %d\n", ctrl->gatename, write ? "write" : "read", buf, len);
 	if (ctrl->dma == 0) {
-		wbuf = (u32int *)buf;
 		WR(ctrl, RINTSTS_REG, RR(ctrl, RINTSTS_REG));	
 		DBG debug_status(ctrl);
-		for(i = 0; i < (len / 4); i++){
+		/*
+		 * the fifo is a word wide, the last word of a length
+		 * that is not a multiple of 4 is partly used. SDIO
+		 * buffers need not be aligned.
+		 */
+		aligned = ((uintptr)buf & 3) == 0;
+		for(i = 0; i < len; i += 4){
+			n = len - i;
+			if(n > 4)
+				n = 4;
 			if (write){
-				while(RR(ctrl, STATUS_REG) & (STATUS_FIFO_FULL)) {
-					DBG iprint("Waiting to write data..\n");
-					delay(5);
+				if(fifowait(ctrl, STATUS_FIFO_FULL) < 0)
+					break;
+				if(aligned && n == 4)
+					w = *(u32int*)(buf+i);
+				else{
+					w = 0;
+					memmove(&w, buf+i, n);
 				}
-				WR(ctrl, FIFO_REG, wbuf[i]);
+				WR(ctrl, FIFO_REG, w);
 			} else {
-				while(RR(ctrl, STATUS_REG) & (STATUS_FIFO_EMPTY)) {
-					// DBG iprint("Waiting for data...\n");
-					delay(5);
-				}
-				wbuf[i] = RR(ctrl, FIFO_REG);
-				// DBG iprint("%s: read %x\n", ctrl->gatename, wbuf[i]);
+				if(fifowait(ctrl, STATUS_FIFO_EMPTY) < 0)
+					break;
+				w = RR(ctrl, FIFO_REG);
+				if(aligned && n == 4)
+					*(u32int*)(buf+i) = w;
+				else
+					memmove(buf+i, &w, n);
 			}
 		}
 	} else {
-		/* DMA */
-		if(write)
-			cachedwbse(buf, len);
-		else
-			cachedwbinvse(buf, len);
-		dmaflush(0, buf, len);
-		dmaflush(0, ctrl->dmac, sizeof(ctrl->dmac));
-		if (ctrl->dmac->config & (1<<31) != 0)
+		/* DMA, drop what the cpu fetched speculatively meanwhile */
+		tsleep(&ctrl->r, datadone, ctrl, 3000);
+		if(!write)
+			dmaflush(0, buf, len);
+		dmaflush(0, ctrl->dmac, sizeof(IdmacChain));
+		if (ctrl->dmac->config & IDMAC_CONFIG_DES_OWNER_FLAG)
 			iprint("%s: dmac still owns descriptor!\n", ctrl->gatename);
 		if(ctrl->datadone != 1) {
 			iprint("%s: Data not done\n", ctrl->gatename);
+			/* stop the engine before the descriptors go */
+			WR(ctrl, DMAC_REG, DMAC_IDMAC_RST);
 		}
 		DBG iprint("%s: DMA Complete! :%s\n", ctrl->gatename, (char *)buf);
-		sdfree(ctrl->dmac);
-		ctrl->dmac = nil;
+		dmacfree(ctrl);
 	}
 	WR(ctrl, IDST_REG, RR(ctrl, IDST_REG));
 	WR(ctrl, RINTSTS_REG, RR(ctrl, RINTSTS_REG));
@@ -796,7 +2479,8 @@ sdhcbus(SDio* s, int width, int speed)
 		iprint("%s: mmc bus: invalid width\n", ctrl->gatename);
 	}
 	if(speed){
-		setclkspeed(ctrl, speed);
+		ctrl->busclk = speed;
+		setclkspeed(ctrl, speed >> ctrl->clkstep);
 	}
 }
 
@@ -819,6 +2503,7 @@ static Ctrlr ctrls[3] = {
 		.ntsr = 1,
 		.initialize = 1,
 		.maxdma = 0x10000,
+		.cdpin = "PF6",
 	},
 	{
 		.gatename = "SMHC1",
@@ -828,8 +2513,9 @@ static Ctrlr ctrls[3] = {
 		.intname = "sdmmc1",
 		.mask_data0 = 1,
 		.ntsr = 1,
-		.initialize = 0,
+		.initialize = 1,
 		.maxdma = 0x10000,
+		.sdio = 1,
 	},
 	{
 		.gatename = "SMHC2",
@@ -858,7 +2544,7 @@ static SDio mmc[3] = {
 		.led = sdhcled,
 		.aux = &ctrls[0]
 	},
-	/* Unused? */
+	/* WiFi, SDIO, see sdioinit */
 	 {
 		.name = "SMHC1",
 		.init = sdhcinit,
@@ -886,12 +2572,610 @@ static SDio mmc[3] = {
 	}
 };
 
+static int
+sdiopending(void*)
+{
+	return sdio.pending;
+}
+
+/* CMD52, the caller holds the gate */
+static int
+cmd52(Ctrlr *ctrl, int write, int fn, ulong addr, int v)
+{
+	u32int resp[4], arg;
+
+	arg = write<<31 | fn<<28 | (addr & 0x1ffff)<<9 | (v & 0xff);
+	if(!cmdissue(ctrl, &IO_RW_DIRECT, cmdbits(ctrl, &IO_RW_DIRECT), arg, resp)
+	|| (resp[0] & R5_ERRORS) != 0)
+		error(Eio);
+	return resp[0] & 0xff;
+}
+
+/* stop a failed CMD53, the caller holds the gate */
+static void
+sdioabort(Ctrlr *ctrl, int fn)
+{
+	recover(ctrl);
+	if(!waserror()){
+		cmd52(ctrl, 1, 0, CCCR_ABORT, fn);
+		poperror();
+	}
+}
+
+static int
+sdiocmd(Ctrlr *ctrl, SDiocmd *cmd, u32int arg, u32int *resp)
+{
+	return cmdissue(ctrl, cmd, cmdbits(ctrl, cmd), arg, resp);
+}
+
+/*
+ * Power up the WiFi module and bring SMHC1 and the card to
+ * a 4 bit bus, at 50MHz if the card can do high speed. The
+ * controller is set up once; a later call after a failure
+ * pulses WL_REG_ON and enumerates the card again.
+ */
+static void
+sdioinit(void)
+{
+	Ctrlr *ctrl = &ctrls[1];
+	u32int resp[4], ocr;
+	char pin[8];
+	int i;
+
+	if(!sdio.ctlrup){
+		setpmicvolt("DLDO4", 3300);
+		setpmicstate("DLDO4", 1);
+		for(i = 0; i < 6; i++){
+			snprint(pin, sizeof pin, "PG%d", i);
+			piocfg(pin, 2);	/* SDC1 */
+			if(i > 0)
+				piopull(pin, PioPullUp);
+		}
+		piocfg(Sdioregon, PioOutput);
+		if(sdhcinit(&mmc[1]) < 0)
+			error("sdio: controller init failed");
+		sdhcenable(&mmc[1]);
+		sdio.ctlrup = 1;
+	}
+	pioset(Sdioregon, 0);
+	delay(10);
+	pioset(Sdioregon, 1);
+	delay(100);
+	sdhcbus(&mmc[1], 1, 400000);
+
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	if(!sdiocmd(ctrl, &IO_SEND_OP_COND, 0, resp))
+		error("sdio: no card");
+	ocr = resp[0] & Sdiovolt;
+	if(ocr == 0)
+		error("sdio: voltage not supported");
+	for(i = 0;; i++){
+		if(!sdiocmd(ctrl, &IO_SEND_OP_COND, ocr, resp))
+			error("sdio: no card");
+		if(resp[0] & (1<<31))
+			break;
+		if(i >= 100)
+			error("sdio: card not ready");
+		tsleep(&up->sleep, return0, nil, 10);
+	}
+	sdio.nfn = resp[0]>>28 & 7;
+	if(!sdiocmd(ctrl, &IO_SEND_RCA, 0, resp))
+		error("sdio: no address");
+	sdio.rca = resp[0] >> 16;
+	if(!sdiocmd(ctrl, &IO_SELECT, sdio.rca<<16, resp))
+		error("sdio: select failed");
+
+	/* 4 bit bus, card detect pull-up off */
+	cmd52(ctrl, 1, 0, CCCR_BUSIF, (cmd52(ctrl, 0, 0, CCCR_BUSIF, 0) & ~3) | 0x80 | 2);
+	sdhcbus(&mmc[1], 4, 0);
+	sdio.hz = Sdioslow;
+	if(cmd52(ctrl, 0, 0, CCCR_SPEED, 0) & 1){
+		cmd52(ctrl, 1, 0, CCCR_SPEED, 2);
+		sdio.hz = Sdioclk;
+	}
+	sdhcbus(&mmc[1], 0, sdio.hz);
+	poperror();
+	gateleave(ctrl);
+	sdio.ready = 1;
+	iprint("%s: sdio card, %d functions, %dHz\n", ctrl->gatename, sdio.nfn, sdio.hz);
+}
+
+/*
+ * Card interrupts are level triggered, the function's
+ * handler has to clear the source in the card.
+ */
+static void
+sdioproc(void *a)
+{
+	Ctrlr *ctrl = a;
+	int pend, fn;
+
+	for(;;){
+		sleep(&sdio.r, sdiopending, nil);
+		sdio.pending = 0;
+		sdio.irqs++;
+		if(waserror()){
+			iprint("%s: sdio interrupt: %s\n", ctrl->gatename, up->errstr);
+			pend = 0;
+		}else{
+			pend = sdiordb(0, CCCR_INTPEND);
+			poperror();
+		}
+		for(fn = 1; fn < Nsdiofn; fn++)
+			if((pend & 1<<fn) != 0 && sdio.intr[fn] != nil)
+				sdio.intr[fn](sdio.arg[fn]);
+		WR(ctrl, INTMASK_REG, RR(ctrl, INTMASK_REG) | INT_SDIOI_INT);
+	}
+}
+
+static Ctrlr*
+sdioctrl(void)
+{
+	if(!sdio.ready)
+		error("sdio: not attached");
+	return &ctrls[1];
+}
+
+/*
+ * Enable function fn of the SDIO card, powering it up on first
+ * use. intr, if not nil, is called with arg for the function's
+ * interrupts. Returns the number of functions on the card.
+ */
+int
+sdioattach(int fn, void (*intr)(void*), void *arg)
+{
+	Ctrlr *ctrl = &ctrls[1];
+	int i;
+
+	if(fn < 1 || fn >= Nsdiofn)
+		error(Ebadarg);
+	qlock(&sdio);
+	if(waserror()){
+		qunlock(&sdio);
+		nexterror();
+	}
+	if(!sdio.ready)
+		sdioinit();
+	if(fn > sdio.nfn)
+		error("sdio: no such function");
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	cmd52(ctrl, 1, 0, CCCR_IOEN, cmd52(ctrl, 0, 0, CCCR_IOEN, 0) | 1<<fn);
+	for(i = 0; (cmd52(ctrl, 0, 0, CCCR_IORDY, 0) & 1<<fn) == 0; i++){
+		if(i >= 100)
+			error("sdio: function not ready");
+		tsleep(&up->sleep, return0, nil, 10);
+	}
+	if(intr != nil){
+		sdio.intr[fn] = intr;
+		sdio.arg[fn] = arg;
+		cmd52(ctrl, 1, 0, CCCR_INTEN, cmd52(ctrl, 0, 0, CCCR_INTEN, 0) | 1 | 1<<fn);
+		if(!sdio.irqproc){
+			sdio.irqproc = 1;
+			kproc("sdioirq", sdioproc, ctrl);
+		}
+		WR(ctrl, INTMASK_REG, RR(ctrl, INTMASK_REG) | INT_SDIOI_INT);
+	}
+	poperror();
+	gateleave(ctrl);
+	poperror();
+	qunlock(&sdio);
+	return sdio.nfn;
+}
+
+/* block size for CMD53 block mode transfers of function fn */
+void
+sdioblksize(int fn, int size)
+{
+	Ctrlr *ctrl = sdioctrl();
+
+	if(fn < 0 || fn >= Nsdiofn || size <= 0 || size > 2048)
+		error(Ebadarg);
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	cmd52(ctrl, 1, 0, fn*0x100 + FBR_BLKSIZE, size & 0xff);
+	cmd52(ctrl, 1, 0, fn*0x100 + FBR_BLKSIZE + 1, size >> 8);
+	sdio.blksize[fn] = size;
+	poperror();
+	gateleave(ctrl);
+}
+
+int
+sdiordb(int fn, ulong addr)
+{
+	Ctrlr *ctrl = sdioctrl();
+	int v;
+
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	v = cmd52(ctrl, 0, fn, addr, 0);
+	poperror();
+	gateleave(ctrl);
+	return v;
+}
+
+void
+sdiowrb(int fn, ulong addr, int v)
+{
+	Ctrlr *ctrl = sdioctrl();
+
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	cmd52(ctrl, 1, fn, addr, v);
+	poperror();
+	gateleave(ctrl);
+}
+
+/*
+ * CMD53. Uses block mode for whole blocks once sdioblksize was
+ * set for the function, byte mode for the rest. incr selects an
+ * incrementing address rather than a fixed one, as for a fifo.
+ */
+long
+sdiorw(int write, int fn, ulong addr, int incr, void *buf, long len)
+{
+	Ctrlr *ctrl = sdioctrl();
+	SDiocmd *cmd;
+	u32int resp[4], arg;
+	uchar *p;
+	long n, done;
+	int bs, nb;
+
+	if(fn < 0 || fn >= Nsdiofn || len < 0)
+		error(Ebadarg);
+	cmd = write ? &IO_WRITE_EXTENDED : &IO_READ_EXTENDED;
+	bs = sdio.blksize[fn];
+	p = buf;
+	gateenter(ctrl);
+	if(waserror()){
+		gateleave(ctrl);
+		nexterror();
+	}
+	for(done = 0; done < len; done += n){
+		n = len - done;
+		arg = write<<31 | fn<<28 | (incr != 0)<<26 | (addr & 0x1ffff)<<9;
+		if(bs > 0 && n >= bs){
+			nb = MIN(n/bs, 511);
+			n = nb*bs;
+			arg |= 1<<27 | nb;
+			xfersetup(ctrl, write, p, bs, nb);
+		}else{
+			n = MIN(n, 512);
+			arg |= n & 0x1ff;
+			xfersetup(ctrl, write, p, n, 1);
+		}
+		if(!cmdissue(ctrl, cmd, cmdbits(ctrl, cmd), arg, resp) || (resp[0] & R5_ERRORS) != 0){
+			sdioabort(ctrl, fn);
+			error(Eio);
+		}
+		xferdone(ctrl, write, p, n);
+		if(!xferok(ctrl)){
+			sdioabort(ctrl, fn);
+			error(Eio);
+		}
+		p += n;
+		if(incr)
+			addr += n;
+	}
+	poperror();
+	gateleave(ctrl);
+	return len;
+}
+
+static Ctrlr*
+ctrlbyname(char *name)
+{
+	int i;
+
+	for(i = 0; i < nelem(ctrls); i++)
+		if(cistrcmp(ctrls[i].gatename, name) == 0 && ctrls[i].initialize)
+			return &ctrls[i];
+	error("no such controller");
+	return nil;
+}
+
+static long
+sdhcstatread(Chan*, void *a, long n, vlong offset)
+{
+	char *p;
+	int i, l;
+	Ctrlr *ctrl;
+	Readahead *ra;
+	Iogate *g;
+	Iostats *st;
+
+	p = smalloc(READSTR);
+	l = 0;
+	for(i = 0; i < nelem(ctrls); i++){
+		ctrl = &ctrls[i];
+		if(!ctrl->initialize)
+			continue;
+		ra = &ctrl->ra;
+		l += snprint(p+l, READSTR-l, "%s ra win %d max %d hits %lud misses %lud ahead %lud wasted %lud\n",
+			ctrl->gatename, ra->win, ra->maxwin,
+			ra->hits, ra->misses, ra->ahead, ra->wasted);
+		g = &ctrl->gate;
+		st = &ctrl->stats;
+		l += snprint(p+l, READSTR-l, "%s cmds %lud errors %lud reads %lud writes %lud rbytes %llud wbytes %llud\n",
+			ctrl->gatename, st->cmds, st->cmderrs, st->reads, st->writes, st->rbytes, st->wbytes);
+		l += snprint(p+l, READSTR-l, "%s dma %lud fifo %lud dcrc %lud rcrc %lud dtimeout %lud rtimeout %lud retries %lud\n",
+			ctrl->gatename, st->dma, st->fifo, st->dcrc, st->rcrc, st->dtimeout, st->rtimeout, st->retries);
+		l += snprint(p+l, READSTR-l, "%s xfer errors %lud failed %lud clock %dHz step %d down %lud up %lud\n",
+			ctrl->gatename, st->xfererrs, st->failed, ctrl->clkhz, ctrl->clkstep, st->clkdowns, st->clkups);
+		l += snprint(p+l, READSTR-l, "%s card %s changes %lud discarded %llud\n",
+			ctrl->gatename, ctrl->present ? "present" : "absent", ctrl->changes, ctrl->erased);
+		if(ctrl->mmc)
+			l += snprint(p+l, READSTR-l, "%s cache %s size %ludKB flushes %lud reliable %d writes %lud\n",
+				ctrl->gatename, ctrl->cacheon ? "on" : "off", ctrl->cachesize,
+				ctrl->flushes, ctrl->relmax, ctrl->relwrites);
+		if(ctrl->sdio)
+			l += snprint(p+l, READSTR-l, "%s sdio %s functions %d clock %dHz irqs %lud\n",
+				ctrl->gatename, sdio.ready ? "up" : "down", sdio.nfn, sdio.hz, sdio.irqs);
+		l += snprint(p+l, READSTR-l, "%s gate waits %lud maxwait %ludms\n",
+			ctrl->gatename, g->nwaits, g->maxwait);
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static long
+sdhchistread(Chan*, void *a, long n, vlong offset)
+{
+	static char *sizes[Nsize] = { "512", "4k", "64k", "big" };
+	char *p;
+	int i, l, w, sz, b;
+	Iostats *st;
+
+	p = smalloc(READSTR);
+	l = snprint(p, READSTR, "µs<");
+	for(b = 0; b < Nlat-1; b++)
+		l += snprint(p+l, READSTR-l, " %lud", 1UL<<(b+Latshift));
+	l += snprint(p+l, READSTR-l, " inf max\n");
+	for(i = 0; i < nelem(ctrls); i++){
+		if(!ctrls[i].initialize)
+			continue;
+		st = &ctrls[i].stats;
+		for(w = 0; w < 2; w++)
+		for(sz = 0; sz < Nsize; sz++){
+			l += snprint(p+l, READSTR-l, "%s %s %s", ctrls[i].gatename, w ? "write" : "read", sizes[sz]);
+			for(b = 0; b < Nlat; b++)
+				l += snprint(p+l, READSTR-l, " %lud", st->hist[w][sz][b]);
+			l += snprint(p+l, READSTR-l, " %lud\n", st->maxlat[w][sz]);
+		}
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static char*
+dlname(int reg)
+{
+	return reg == DS_DL_REG ? "dsdl" : "sampdl";
+}
+
+static long
+sdhccalread(Chan*, void *a, long n, vlong offset)
+{
+	char *p, *s, *e;
+	int i, d;
+	Ctrlr *ctrl;
+	Calset *cs;
+
+	/* the settings, a sweep header and its points for each */
+	p = smalloc(nelem(ctrls)*(Ncalset+1+Ncal)*Calline);
+	s = p;
+	e = p + nelem(ctrls)*(Ncalset+1+Ncal)*Calline;
+	for(i = 0; i < nelem(ctrls); i++){
+		ctrl = &ctrls[i];
+		if(!ctrl->initialize)
+			continue;
+		for(cs = ctrl->calset; cs < &ctrl->calset[Ncalset]; cs++)
+			if(cs->hz != 0)
+				s = seprint(s, e, "%s %s %dHz delay %d\n",
+					ctrl->gatename, dlname(cs->reg), cs->hz, cs->delay);
+		if(ctrl->calhz == 0)
+			continue;
+		s = seprint(s, e, "%s sweep %s %dHz best %d\n",
+			ctrl->gatename, dlname(ctrl->calreg), ctrl->calhz, ctrl->calbest);
+		for(d = 0; d < Ncal; d++)
+			s = seprint(s, e, "%s %2d errors %lud kbps %lud\n",
+				ctrl->gatename, d, ctrl->cal[d].errors, ctrl->cal[d].kbps);
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static long
+sdhcbenchread(Chan*, void *a, long n, vlong offset)
+{
+	char *p;
+	int i, j, l;
+	Ctrlr *ctrl;
+	Bench *b;
+	uvlong kbps, iops;
+
+	p = smalloc(READSTR);
+	l = 0;
+	for(i = 0; i < nelem(ctrls); i++){
+		ctrl = &ctrls[i];
+		for(j = 0; j < ctrl->nbench; j++){
+			b = &ctrl->bench[j];
+			kbps = iops = 0;
+			if(b->us > 0){
+				kbps = b->bytes*1000000 / (b->us*1024);
+				iops = (b->ops - b->errors)*1000000ULL / b->us;
+			}
+			l += snprint(p+l, READSTR-l, "%s %s %d qd %d ops %d errors %d %llud.%02lludMB/s iops %llud p50 %lud p90 %lud p99 %lud max %ludµs\n",
+				ctrl->gatename, b->name, b->bsize, b->depth, b->ops, b->errors,
+				kbps/1024, (kbps%1024)*100/1024, iops,
+				b->p50, b->p90, b->p99, b->max);
+		}
+	}
+	n = readstr(offset, a, n, p);
+	free(p);
+	return n;
+}
+
+static long
+sdhcctlwrite(Chan*, void *a, long n, vlong)
+{
+	Cmdbuf *cb;
+	Ctrlr *ctrl;
+	Readahead *ra;
+	char *e;
+	long v;
+	int w;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf < 2)
+		error(Ebadctl);
+	ctrl = ctrlbyname(cb->f[1]);
+
+	if(strcmp(cb->f[0], "readahead") == 0){
+		/* readahead ctlr blocks|off|reset */
+		if(cb->nf != 3)
+			error(Ebadarg);
+		ra = &ctrl->ra;
+		if(strcmp(cb->f[2], "reset") == 0){
+			ra->hits = ra->misses = ra->ahead = ra->wasted = 0;
+		}else{
+			if(strcmp(cb->f[2], "off") == 0)
+				w = 0;
+			else
+				w = atoi(cb->f[2]);
+			if(w < 0 || w >= RAbufblk)
+				error("window out of range");
+			ra->maxwin = w;
+			if(ra->win > w)
+				ra->win = w;
+		}
+	}else if(strcmp(cb->f[0], "trim") == 0 || strcmp(cb->f[0], "discard") == 0){
+		/* trim|discard ctlr lba count */
+		if(cb->nf != 4)
+			error(Ebadarg);
+		discard(ctrl, strtoull(cb->f[2], nil, 0), strtoull(cb->f[3], nil, 0),
+			cb->f[0][0] == 't' ? Etrim : Ediscard);
+	}else if(strcmp(cb->f[0], "cache") == 0 || strcmp(cb->f[0], "flush") == 0){
+		/* cache ctlr on|off, flush ctlr */
+		if(!ctrl->mmc || ctrl->cachesize == 0)
+			error("card has no cache");
+		if(cb->f[0][0] == 'c'){
+			if(cb->nf != 3)
+				error(Ebadarg);
+			if(strcmp(cb->f[2], "on") == 0)
+				ctrl->cachewant = 1;
+			else if(strcmp(cb->f[2], "off") == 0)
+				ctrl->cachewant = 0;
+			else
+				error(Ebadarg);
+		}
+		gateenter(ctrl);
+		if(waserror()){
+			gateleave(ctrl);
+			nexterror();
+		}
+		if(cb->f[0][0] == 'c'){
+			cacheset(ctrl);
+			flushstart(ctrl);
+		}else
+			cacheflush(ctrl);
+		poperror();
+		gateleave(ctrl);
+	}else if(strcmp(cb->f[0], "reliable") == 0){
+		/* reliable ctlr blocks|off */
+		if(cb->nf != 3)
+			error(Ebadarg);
+		if(strcmp(cb->f[2], "off") == 0)
+			ctrl->relmax = 0;
+		else{
+			v = strtol(cb->f[2], &e, 0);
+			if(*e != 0 || v < 0 || v > 0xFFFF)
+				error(Ebadarg);
+			ctrl->relmax = v;
+		}
+	}else if(strcmp(cb->f[0], "calibrate") == 0){
+		/* calibrate ctlr lba count [sampdl|dsdl], calibrate ctlr reset */
+		if(cb->nf == 3 && strcmp(cb->f[2], "reset") == 0)
+			memset(ctrl->calset, 0, sizeof ctrl->calset);
+		else if(cb->nf == 4)
+			calibrate(ctrl, SAMP_DL_REG, strtoull(cb->f[2], nil, 0), atoi(cb->f[3]));
+		else if(cb->nf == 5 && strcmp(cb->f[4], "sampdl") == 0)
+			calibrate(ctrl, SAMP_DL_REG, strtoull(cb->f[2], nil, 0), atoi(cb->f[3]));
+		else if(cb->nf == 5 && strcmp(cb->f[4], "dsdl") == 0)
+			calibrate(ctrl, DS_DL_REG, strtoull(cb->f[2], nil, 0), atoi(cb->f[3]));
+		else
+			error(Ebadarg);
+	}else if(strcmp(cb->f[0], "bench") == 0){
+		/* bench ctlr lba count [ops [seed [read|write [depth]]]] */
+		if(cb->nf < 4 || cb->nf > 8
+		|| (cb->nf >= 7 && strcmp(cb->f[6], "write") != 0 && strcmp(cb->f[6], "read") != 0))
+			error(Ebadarg);
+		bench(ctrl, strtoull(cb->f[2], nil, 0), strtoull(cb->f[3], nil, 0),
+			cb->nf > 4 ? atoi(cb->f[4]) : Benchops,
+			cb->nf > 5 ? strtoul(cb->f[5], nil, 0) : 1,
+			cb->nf >= 7 && strcmp(cb->f[6], "write") == 0,
+			cb->nf > 7 ? atoi(cb->f[7]) : 1);
+	}else if(strcmp(cb->f[0], "stats") == 0){
+		/* stats ctlr reset */
+		if(cb->nf != 3 || strcmp(cb->f[2], "reset") != 0)
+			error(Ebadarg);
+		memset(&ctrl->stats, 0, sizeof ctrl->stats);
+	}else
+		error(Ebadctl);
+
+	free(cb);
+	poperror();
+	return n;
+}
+
 void
 sdhclink(void)
 {	
+	int i;
+
+	for(i = 0; i < nelem(ctrls); i++){
+		ctrls[i].ra.maxwin = RAdefwin;
+		ctrls[i].cachewant = 0;
+		ctrls[i].present = 1;
+		if(ctrls[i].cdpin != nil){
+			piocfg(ctrls[i].cdpin, PioInput);
+			piopull(ctrls[i].cdpin, PioPullUp);
+		}
+	}
+
 	addmmcio(&mmc[0]);
-	// addmmcio(&mmc[1]);
+	/* SMHC1 is SDIO, brought up by sdioattach */
 	addmmcio(&mmc[2]);
+
+	addarchfile("sdhcstat", 0444, sdhcstatread, nil);
+	addarchfile("sdhchist", 0444, sdhchistread, nil);
+	addarchfile("sdhccal", 0444, sdhccalread, nil);
+	addarchfile("sdhcbench", 0444, sdhcbenchread, nil);
+	addarchfile("sdhcctl", 0220, nil, sdhcctlwrite);
+	addshutdown(sdhcshutdown);
 }
 
 /* HERE BE DRAGONS */
@@ -0,0 +1,45 @@
+/*
+ * ../arm64/trap.c, which this file replaces in the build, with
+ * the context switch hooks wrapped so that the per-process pmu
+ * counters are switched along with the fpu.
+ */
+
+#define procfork	arm64procfork
+#define procsetup	arm64procsetup
+#define procsave	arm64procsave
+#define procrestore	arm64procrestore
+
+#include "../arm64/trap.c"
+
+#undef procfork
+#undef procsetup
+#undef procsave
+#undef procrestore
+
+void
+procfork(Proc *p)
+{
+	arm64procfork(p);
+	pmuprocfork(p);
+}
+
+void
+procsetup(Proc *p)
+{
+	arm64procsetup(p);
+	pmuprocsetup(p);
+}
+
+void
+procsave(Proc *p)
+{
+	arm64procsave(p);
+	pmuprocsave(p);
+}
+
+void
+procrestore(Proc *p)
+{
+	arm64procrestore(p);
+	pmuprocrestore(p);
+}